@@ -0,0 +1,357 @@
+/*  bench.c
+    Public Domain
+
+    A benchmark harness for the JSDev library. It generates synthetic
+    corpora with controlled characteristics - comment density, string
+    literal ratio, tagged comment frequency, and file sizes from 1 KB to
+    100 MB - then runs the transformation over each through the memory
+    mapped, buffered stream, and memory to memory paths, and reports
+    MB/s, instructions per byte, and peak RSS across repetitions.
+
+        jsdev_bench [size ...]
+
+    With no arguments the standard ladder of sizes is used. Sizes are in
+    bytes. The corpora are deterministic, so two runs on the same machine
+    measure the same work. Instructions are counted with perf events
+    where the kernel offers them; elsewhere that column reads zero.
+*/
+
+#include "jsdev.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#define FALSE 0
+#define TRUE  1
+
+#define NR_REPS(size) ((size) <= 1024 * 1024 ? 20 \
+    : (size) <= 16 * 1024 * 1024 ? 5 : 3)
+
+/*
+    A corpus profile controls what the generator writes: out of every
+    hundred statements, how many are string assignments, how many are
+    plain comments, and how many are tagged comments. Half of the tagged
+    comments use declared tags and expand; the rest miss.
+*/
+
+struct profile {
+    char* name;
+    int   string_pct;
+    int   comment_pct;
+    int   tagged_pct;
+};
+
+static struct profile profiles[] = {
+    {"plain",    10,  2,  0},
+    {"stringy",  40,  5,  1},
+    {"commenty", 10, 25,  8},
+};
+
+static char* tag_names[] = {
+    "debug", "trace:tracer.trace", "test_expose", "assert:console.assert"
+};
+
+static unsigned long long seed;
+
+
+static unsigned long
+spin(void)
+{
+/*
+    A small xorshift pseudo random number generator, reseeded for each
+    corpus so the files do not depend on generation order.
+*/
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return (unsigned long)(seed >> 32);
+}
+
+
+static void
+word(FILE* out)
+{
+    static char* words[] = {
+        "value", "total", "index", "node", "result", "count",
+        "item", "left", "right", "state", "sum", "name"
+    };
+    fputs(words[spin() % (sizeof words / sizeof words[0])], out);
+    fprintf(out, "_%lu", spin() % 100);
+}
+
+
+static void
+statement(FILE* out, struct profile* mix)
+{
+/*
+    Write one line of generated program text, picking its flavor from the
+    profile's percentages.
+*/
+    unsigned long pick = spin() % 100;
+    if (pick < (unsigned long)mix->tagged_pct) {
+        if (spin() % 2 == 0) {
+            fputs("/*debug report(\"state\", ", out);
+            word(out);
+            fputs(");*/\n", out);
+        } else {
+            fputs("/*unknown_tag nothing(", out);
+            word(out);
+            fputs(");*/\n", out);
+        }
+    } else if (pick < (unsigned long)(mix->tagged_pct + mix->comment_pct)) {
+        if (spin() % 2 == 0) {
+            fputs("// a line comment about ", out);
+            word(out);
+            fputs("\n", out);
+        } else {
+            fputs("/* a block comment about ", out);
+            word(out);
+            fputs(" */\n", out);
+        }
+    } else if (pick < (unsigned long)(mix->tagged_pct + mix->comment_pct
+            + mix->string_pct)) {
+        fputs("var ", out);
+        word(out);
+        fputs(" = \"some text with / slashes and 'quotes' in it\";\n", out);
+    } else {
+        fputs("var ", out);
+        word(out);
+        fputs(" = ", out);
+        word(out);
+        fprintf(out, " + %lu * (", spin() % 1000);
+        word(out);
+        fputs(" - 1);\n", out);
+    }
+}
+
+
+static void
+generate(char* path, struct profile* mix, size_t size)
+{
+    FILE* out = fopen(path, "wb");
+    if (out == NULL) {
+        fputs("jsdev_bench: cannot write corpus.\n", stderr);
+        exit(1);
+    }
+    seed = 8675309 + size;
+    while ((size_t)ftell(out) < size) {
+        statement(out, mix);
+    }
+    fclose(out);
+}
+
+
+static double
+now(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec * 1e-9;
+}
+
+
+#if defined(__linux__)
+
+static int instruction_counter = -1;
+
+static void
+open_counter(void)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof attr;
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    instruction_counter = (int)syscall(SYS_perf_event_open, &attr,
+        0, -1, -1, 0);
+}
+
+
+static void
+start_counter(void)
+{
+    if (instruction_counter >= 0) {
+        ioctl(instruction_counter, PERF_EVENT_IOC_RESET, 0);
+        ioctl(instruction_counter, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+
+static long long
+stop_counter(void)
+{
+    long long count = 0;
+    if (instruction_counter >= 0) {
+        ioctl(instruction_counter, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(instruction_counter, &count, sizeof count)
+                != sizeof count) {
+            count = 0;
+        }
+    }
+    return count;
+}
+
+#else
+
+static void open_counter(void) {}
+static void start_counter(void) {}
+static long long stop_counter(void) { return 0; }
+
+#endif
+
+
+static void
+check(int result, jsdev_context* ctx)
+{
+    if (result != 0) {
+        fprintf(stderr, "jsdev_bench: corpus failed: %d. %s\n",
+            jsdev_line(ctx), jsdev_message(ctx));
+        exit(1);
+    }
+}
+
+
+static void
+measure(jsdev_context* ctx, char* path, size_t size)
+{
+/*
+    Run the corpus through each processing path, keeping the best time
+    and its instruction count over the repetitions, and print one row.
+*/
+    char* modes[] = {"mapped", "stream", "memory"};
+    char* source;
+    char* result;
+    double best, elapsed, started;
+    int mode, rep;
+    long long best_count, count;
+    size_t result_length;
+    FILE* in;
+    FILE* null;
+
+/*
+    The generator finishes its last statement, so the file runs a little
+    past the requested size. Measure what is actually there.
+*/
+    in = fopen(path, "rb");
+    if (in == NULL || fseek(in, 0, SEEK_END) != 0) {
+        exit(1);
+    }
+    size = (size_t)ftell(in);
+    fclose(in);
+    printf("%-9s %9lu", strrchr(path, '-') + 1, (unsigned long)size);
+    for (mode = 0; mode < 3; mode += 1) {
+        best = -1.0;
+        best_count = 0;
+        for (rep = 0; rep < NR_REPS(size); rep += 1) {
+            null = fopen("/dev/null", "wb");
+            if (null == NULL) {
+                exit(1);
+            }
+            if (mode == 0) {
+                started = now();
+                start_counter();
+                check(jsdev_file(ctx, path, null), ctx);
+                count = stop_counter();
+                elapsed = now() - started;
+            } else if (mode == 1) {
+                in = fopen(path, "rb");
+                if (in == NULL) {
+                    exit(1);
+                }
+                started = now();
+                start_counter();
+                check(jsdev_stream(ctx, in, null), ctx);
+                count = stop_counter();
+                elapsed = now() - started;
+                fclose(in);
+            } else {
+                in = fopen(path, "rb");
+                source = malloc(size);
+                if (in == NULL || source == NULL
+                        || fread(source, 1, size, in) != size) {
+                    exit(1);
+                }
+                fclose(in);
+                started = now();
+                start_counter();
+                check(jsdev_transform(ctx, source, size,
+                    &result, &result_length), ctx);
+                count = stop_counter();
+                elapsed = now() - started;
+                free(result);
+                free(source);
+            }
+            fclose(null);
+            if (best < 0.0 || elapsed < best) {
+                best = elapsed;
+                best_count = count;
+            }
+        }
+        printf("  %s %7.1f MB/s %5.2f i/B", modes[mode],
+            (double)size / best * 1e-6,
+            (double)best_count / (double)size);
+    }
+    printf("\n");
+}
+
+
+extern int
+main(int argc, char* argv[])
+{
+    char path[4096];
+    int i, p;
+    size_t sizes[16];
+    int nr_sizes = 0;
+    struct rusage usage;
+    jsdev* set;
+    jsdev_context* ctx;
+
+    if (argc > 1) {
+        for (i = 1; i < argc && nr_sizes < 16; i += 1) {
+            sizes[nr_sizes] = (size_t)strtoul(argv[i], NULL, 10);
+            nr_sizes += 1;
+        }
+    } else {
+        sizes[0] = 1024;
+        sizes[1] = 32 * 1024;
+        sizes[2] = 1024 * 1024;
+        sizes[3] = 16 * 1024 * 1024;
+        sizes[4] = 100 * 1024 * 1024;
+        nr_sizes = 5;
+    }
+    set = jsdev_make(sizeof tag_names / sizeof tag_names[0], tag_names,
+        0, NULL, NULL);
+    ctx = set == NULL ? NULL : jsdev_context_make(set);
+    if (ctx == NULL) {
+        fputs("jsdev_bench: out of memory.\n", stderr);
+        return 1;
+    }
+    open_counter();
+    for (p = 0; p < (int)(sizeof profiles / sizeof profiles[0]); p += 1) {
+        for (i = 0; i < nr_sizes; i += 1) {
+            snprintf(path, sizeof path, "%s/jsdev_bench-%s",
+                getenv("TMPDIR") == NULL ? "/tmp" : getenv("TMPDIR"),
+                profiles[p].name);
+            generate(path, profiles + p, sizes[i]);
+            measure(ctx, path, sizes[i]);
+            unlink(path);
+        }
+    }
+    getrusage(RUSAGE_SELF, &usage);
+    printf("peak RSS %ld KB\n", usage.ru_maxrss);
+    return 0;
+}
@@ -16,14 +16,14 @@
         /*<tag> <stuff>*/
         /*<tag>(<condition>) <stuff>*/
 /*
-    The command line will contain a list of <tag> names, each of which can
+    The tag set will contain a list of <tag> names, each of which can
     optionally be followed by a colon and <method> name. There must not be
     any spaces around the colon.
 
     A <tag> may contain any short sequence of ASCII letters, digits,
     underbar (_), dollar ($), and period(.). The active <tag> strings are
-    declared in the method line. All <tag>s that are not declared in the
-    command line are ignored.
+    declared in the tag set. All <tag>s that are not declared in the tag
+    set are ignored.
 
     The <condition> and <stuff> may not include a string or regexp containing
     starslash, or a comment.
@@ -50,79 +50,312 @@
 
         if (<condition>) {<method>(<stuff>);}
 
-    Also, a method line can contain a comment.
+    A tag set can also carry comment strings, each of which is prepended to
+    the output as a // comment.
 
-        -comment <comment>
+    This file is the library: a compiled tag set (jsdev) is shared by any
+    number of scanner contexts (jsdev_context), one per thread, and errors
+    are reported through return codes rather than exit. The command line
+    tool lives in main.c. The public interface is in jsdev.h.
+*/
 
-            A string that will be prepended to the output as a comment.
+#include "jsdev.h"
 
-    Sample method line:
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 
-        jsdev debug log:console.log alarm:alert -comment "Devel Edition"
+#include <fcntl.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
 
-    That will enable
-*/
-        /*debug <stuff>*/
-/*
-    comments that expand into
+#define FALSE          0
+#define READ_BUFFER_SIZE (1024 * 1024)
+#define TRUE           1
 
-        {<stuff>;}
+#define WRITE_BUFFER_SIZE (1024 * 1024)
 
-    as well as
+/*
+    The parallel scan splits a mapped input into shards of at least this
+    many bytes; anything smaller is not worth the threads.
 */
-        /*log <stuff>*/
+
+#define SHARD_MIN (4 * 1024 * 1024)
+
 /*
-    comments that expand into
+    The prefetch block of a pipelined context is empty while the reader
+    thread is filling it, full when bytes are waiting, and done at end of
+    file.
+*/
 
-        {console.log(<stuff>);}
+#define PREFETCH_EMPTY 0
+#define PREFETCH_FULL  1
+#define PREFETCH_DONE  2
 
-    and
+/*
+    The declared tags are compiled into a trie over the 65 character tag
+    alphabet. Node zero is the root. trie_child[node][symbol] is the next
+    node, or zero. trie_tag[node] is the tag number plus one if a declared
+    tag ends at the node, or zero.
 */
-        /*alarm(<condition>) <stuff>*/
+
+#define TRIE_WIDTH 65
+
 /*
-    comments that expand into
+    Character classes, one bit each, looked up in class_of with a single
+    indexed load. The scanner's hot paths ask these questions once per
+    token, and on minified input the comparison ladders they replace
+    mispredict badly.
+*/
 
-        if (<condition>) {alert(<stuff>);}
+#define CLASS_ALPHANUM    1   /* letter, digit, underscore, dollar, dot */
+#define CLASS_PRE_REGEXP  2   /* a regexp literal may follow this token */
+#define CLASS_STRING      4   /* a quote or a backtick */
+#define CLASS_WHITESPACE  8   /* space and every control character */
+#define CLASS_INTERESTING 16  /* quote, backtick, slash, or NUL */
+
+static const unsigned char class_of[256] = {
+    24,  8,  8,  8,  8,  8,  8,  8,  8,  8,  8,  8,  8,  8,  8,  8,
+     8,  8,  8,  8,  8,  8,  8,  8,  8,  8,  8,  8,  8,  8,  8,  8,
+     8,  2, 20,  0,  1,  0,  2, 20,  2,  0,  0,  0,  2,  0,  1, 16,
+     1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  2,  2,  0,  2,  0,  2,
+     0,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,
+     1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  2,  0,  0,  0,  1,
+    20,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,
+     1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  2,  2,  2,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0
+};
+
+struct jsdev {
+    unsigned long long fingerprint;
+    int nr_comments;
+    int nr_nodes;
+    int nr_tags;
+    int longest_tag;  /* characters in the longest declared tag */
+    char** comments;
+    char** tags;      /* interned names, pointing into the arena */
+    char** methods;   /* interned, empty string when the tag has none */
+    char** prefixes;  /* "{method(" or "{", opening each expansion */
+    char** suffixes;  /* ");}" or "}", closing it */
+    char*  arena;     /* one block holding every distinct tag and method */
+    int (*trie_child)[TRIE_WIDTH];
+    int* trie_tag;
+    signed char symbol_of[256];
+};
 
-    It will also insert the comment
+/*
+    A channel is one output of a scan. An ordinary context has one; a fan
+    out context has one per tag set, so a single pass of the scanner can
+    feed several variants of the output. tag_of maps a tag number from the
+    scan trie to the channel's own tag number plus one, or zero when the
+    channel does not declare the tag; NULL means the scan set is the
+    channel's set and the numbers coincide.
+*/
 
-        // Devel Edition
+struct channel {
+    jsdev* set;
+    FILE*  out;
+    int*   tag_of;
+    size_t write_at;
+    size_t written;       /* bytes already retired to the out stream */
+    size_t write_limit;   /* capacity of write_buffer */
+    int    out_mapped;    /* is write_buffer a mapping of the out file? */
+    unsigned char* write_buffer;
+    unsigned char* heap_buffer;  /* the malloc'd buffer, to restore */
+    z_stream* zip;               /* the gzip encoder, or NULL */
+    unsigned char* zip_buffer;   /* the encoder's output scratch */
+};
+
+typedef struct channel channel;
 
-    at the top of the output file.
+/*
+    Everything that changes while one source is being scanned lives in a
+    context, so each thread carries its own. The scanner walks the trie of
+    set, which is the channels' common set, or, in a fan out context, a
+    merged set holding every tag that any channel declares.
+*/
 
-    A program is read from stdin, and a modified program is written to stdout.
+struct jsdev_context {
+    jsdev* set;
+    char*  path;          /* the input file, or NULL */
+    FILE*  in;            /* the byte stream when the input is not mapped */
+    int    cr;            /* was the last retired character a return? */
+    int    line_nr;       /* the line of the failure, for jsdev_line */
+    int    counted_lines; /* line breaks in front of the buffer */
+    size_t base;          /* offset of read_buffer[0] in the whole input */
+    size_t mark;          /* offset where the open literal began */
+    int    mark_line;     /* its line once its bytes are retired, or 0 */
+    int    read_eof;
+    int    read_mapped;
+    size_t read_at;
+    size_t read_limit;
+    size_t map_length;
+    unsigned char* read_buffer;
+    unsigned char* map;
+    unsigned char* stream_buffer;
+    int    nr_channels;
+    int    only_channel;  /* the channel being written, or EOF for all */
+    channel* channels;
+    jsdev* merged;        /* the scan set a fan out context owns, or NULL */
+    int    recording;     /* are consumed characters being captured? */
+    size_t capture_at;
+    size_t capture_limit;
+    unsigned char* capture;
+    unsigned char* tag_word;  /* holds a matched tag during fan out */
+    jsdev_stats* stats;   /* where counters accumulate, or NULL */
+    FILE*  index;         /* where expansion span records go, or NULL */
+    int    indexed;       /* has the current scan written a span record? */
+/*
+    The pipelined mode overlaps reading, scanning, and writing. A reader
+    thread keeps the prefetch block ahead of the scanner, and a writer
+    thread retires one posted output buffer while its channel fills the
+    spare.
+*/
+    int    async;         /* is the pipelined mode on? */
+    int    outmap;        /* write into preallocated output mappings? */
+    int    strip;         /* 0 none, 1 unexpanded patterns, 2 comments */
+    int    reader_on;
+    int    read_quit;
+    int    prefetch_state;
+    size_t prefetch_at;
+    size_t prefetch_length;
+    unsigned char* prefetch;
+    pthread_t reader;
+    pthread_mutex_t read_lock;
+    pthread_cond_t read_filled;
+    pthread_cond_t read_drained;
+    int    writer_on;
+    int    write_quit;
+    int    writing;       /* is a posted write outstanding? */
+    int    write_failed;
+    size_t job_length;
+    unsigned char* job_data;
+    channel* job_chn;
+    unsigned char* spare;
+    pthread_t writer;
+    pthread_mutex_t write_lock;
+    pthread_cond_t write_posted;
+    pthread_cond_t write_taken;
+    jmp_buf* recover;     /* where error() jumps; set by every entry point */
+    char*  error_message;
+};
+
+typedef struct jsdev_context context;
+
+static double
+seconds(void)
+{
+/*
+    Read the monotonic clock, for the opt in stats timings.
 */
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec * 1e-9;
+}
 
-#include <stdlib.h>
-#include <stdio.h>
-#include <string.h>
 
-#define FALSE          0
-#define MAX_NR_TAGS    100
-#define MAX_TAG_LENGTH 80
-#define TRUE           1
+static int
+line_at(context* ctx, size_t at)
+{
+/*
+    Derive the line number of a buffer offset. Line breaks are not
+    tracked while the scanner runs: the breaks in front of the buffer
+    were counted in bulk when their bytes were retired, and the resident
+    prefix is only walked here, when a diagnostic needs it.
+*/
+    int c, cr = ctx->cr, lines = ctx->counted_lines;
+    size_t i;
+    for (i = 0; i < at; i += 1) {
+        c = ctx->read_buffer[i];
+        if (c == '\r') {
+            cr = TRUE;
+            lines += 1;
+        } else {
+            if (c == '\n' && !cr) {
+                lines += 1;
+            }
+            cr = FALSE;
+        }
+    }
+    return lines + 1;
+}
 
-static int  cr;
-static int  line_nr;
-static int  nr_tags;
-static int  preview = 0;
 
-static char methods[MAX_NR_TAGS][MAX_TAG_LENGTH + 1];
-static char tag                 [MAX_TAG_LENGTH + 1];
-static char tags   [MAX_NR_TAGS][MAX_TAG_LENGTH + 1];
+static void
+retire(context* ctx, size_t length)
+{
+/*
+    Account for buffer bytes that are about to be discarded by a refill:
+    count their line breaks, and if the open literal's mark is among
+    them, resolve its line now, while the bytes are still here.
+*/
+    int c;
+    size_t at;
+    for (at = 0; at < length; at += 1) {
+        if (ctx->mark_line == 0 && ctx->base + at == ctx->mark) {
+            ctx->mark_line = ctx->counted_lines + 1;
+        }
+        c = ctx->read_buffer[at];
+        if (c == '\r') {
+            ctx->cr = TRUE;
+            ctx->counted_lines += 1;
+        } else {
+            if (c == '\n' && !ctx->cr) {
+                ctx->counted_lines += 1;
+            }
+            ctx->cr = FALSE;
+        }
+    }
+    ctx->base += length;
+}
+
 
 static void
-error(char* message)
+error(context* ctx, char* message)
 {
-    fputs("JSDev: ", stderr);
-    if (line_nr) {
-        fprintf(stderr, "%d. ", line_nr);
-    } else {
-        fputs("bad method line ", stderr);
+/*
+    line_nr is 1 while the program text is being scanned, and is settled
+    here, on the way out; it stays 0 for failures with no position.
+*/
+    if (ctx->line_nr > 0) {
+        ctx->line_nr = line_at(ctx, ctx->read_at);
     }
-    fputs(message, stderr);
-    fputs("\r\n", stderr);
-    exit(1);
+    ctx->error_message = message;
+    longjmp(*ctx->recover, 1);
+}
+
+
+static void
+error_at_mark(context* ctx, char* message)
+{
+/*
+    Report a failure at the opening of the current literal rather than at
+    the position where the scanner gave up.
+*/
+    ctx->line_nr = ctx->mark >= ctx->base
+        ? line_at(ctx, ctx->mark - ctx->base)
+        : ctx->mark_line;
+    ctx->error_message = message;
+    longjmp(*ctx->recover, 1);
 }
 
 
@@ -133,442 +366,2630 @@ is_alphanum(int c)
     Return TRUE if the character is a letter, digit, underscore,
     dollar sign, or period.
 */
-    return ((c >= 'a' && c <= 'z') ||
-            (c >= '0' && c <= '9') ||
-            (c >= 'A' && c <= 'Z') ||
-             c == '_' || c == '$' || c == '.');
+    return (class_of[c & 0xFF] & CLASS_ALPHANUM) != 0;
 }
 
 
-static int
-emit(int c)
+static void*
+read_worker(void* arg)
 {
 /*
-    Send a character to stdout.
+    The prefetch thread: refill the prefetch block whenever the scanner
+    drains it, so the next read is already underway while the current
+    block is being scanned.
 */
-    if (c > 0 && fputc(c, stdout) == EOF) {
-        error("write error.");
+    context* ctx = arg;
+    size_t length;
+    for (;;) {
+        pthread_mutex_lock(&ctx->read_lock);
+        while (ctx->prefetch_state != PREFETCH_EMPTY && !ctx->read_quit) {
+            pthread_cond_wait(&ctx->read_drained, &ctx->read_lock);
+        }
+        if (ctx->read_quit) {
+            pthread_mutex_unlock(&ctx->read_lock);
+            return NULL;
+        }
+        pthread_mutex_unlock(&ctx->read_lock);
+        length = fread(ctx->prefetch, 1, READ_BUFFER_SIZE, ctx->in);
+        pthread_mutex_lock(&ctx->read_lock);
+        ctx->prefetch_at = 0;
+        ctx->prefetch_length = length;
+        ctx->prefetch_state = length == 0 ? PREFETCH_DONE : PREFETCH_FULL;
+        pthread_cond_signal(&ctx->read_filled);
+        if (length == 0) {
+            pthread_mutex_unlock(&ctx->read_lock);
+            return NULL;
+        }
+        pthread_mutex_unlock(&ctx->read_lock);
     }
-    return c;
 }
 
 
-static void
-emits(char* s)
+static size_t
+take(context* ctx, unsigned char* to, size_t want)
 {
 /*
-    Send a string to stdout.
+    Copy waiting bytes out of the prefetch block, waking the reader when
+    the block drains. Zero means end of file.
 */
-    if (fputs(s, stdout) == EOF) {
-        error("write error.");
+    size_t length;
+    pthread_mutex_lock(&ctx->read_lock);
+    while (ctx->prefetch_state == PREFETCH_EMPTY) {
+        pthread_cond_wait(&ctx->read_filled, &ctx->read_lock);
+    }
+    length = want < ctx->prefetch_length ? want : ctx->prefetch_length;
+    if (length > 0) {
+        memcpy(to, ctx->prefetch + ctx->prefetch_at, length);
+        ctx->prefetch_at += length;
+        ctx->prefetch_length -= length;
+        if (ctx->prefetch_length == 0
+                && ctx->prefetch_state == PREFETCH_FULL) {
+            ctx->prefetch_state = PREFETCH_EMPTY;
+            pthread_cond_signal(&ctx->read_drained);
+        }
     }
+    pthread_mutex_unlock(&ctx->read_lock);
+    return length;
 }
 
 
-static int
-peek()
+static size_t
+more(context* ctx, unsigned char* to, size_t want)
 {
-    if (!preview) {
-        preview = fgetc(stdin);
+/*
+    Get more bytes from the byte stream: straight from fread, or through
+    the prefetch thread when the pipeline is on. If the thread cannot be
+    started, fall back to the plain read.
+*/
+    if (ctx->async) {
+        if (!ctx->reader_on) {
+            ctx->read_quit = FALSE;
+            ctx->prefetch_state = PREFETCH_EMPTY;
+            if (pthread_create(&ctx->reader, NULL, read_worker, ctx) == 0) {
+                ctx->reader_on = TRUE;
+            }
+        }
+        if (ctx->reader_on) {
+            return take(ctx, to, want);
+        }
     }
-    return preview;
+    return fread(to, 1, want, ctx->in);
 }
 
 
-static int
-get(int echo)
+static void
+stop_reader(context* ctx)
 {
 /*
-    Return the next character from the input. If the echo argument is TRUE,
-    then the character will also be emitted.
+    Join the prefetch thread. It is either waiting for the block to
+    drain, or on its way there after its final read.
 */
-    int c;
-    if (preview) {
-        c = preview;
-        preview = 0;
-    } else {
-        c = fgetc(stdin);
-    }
-    if (c <= 0) {
-        return EOF;
-    } else if (c == '\r') {
-        cr = TRUE;
-        line_nr += 1;
-    } else {
-        if (c == '\n' && !cr) {
-            line_nr += 1;
-        }
-        cr = FALSE;
-    }
-    if (echo) {
-        emit(c);
+    if (!ctx->reader_on) {
+        return;
     }
-    return c;
+    pthread_mutex_lock(&ctx->read_lock);
+    ctx->read_quit = TRUE;
+    ctx->prefetch_state = PREFETCH_EMPTY;
+    pthread_cond_signal(&ctx->read_drained);
+    pthread_mutex_unlock(&ctx->read_lock);
+    pthread_join(ctx->reader, NULL);
+    ctx->reader_on = FALSE;
+    ctx->read_quit = FALSE;
+    ctx->prefetch_state = PREFETCH_EMPTY;
 }
 
 
-static void
-unget(int c)
+static int
+deliver(channel* chn, unsigned char* data, size_t length)
 {
-    preview = c;
+/*
+    Hand a run of output bytes to a channel's stream: straight to
+    fwrite, or through the channel's gzip encoder when one is attached.
+    The encoder consumes the run in buffer sized slices, so a run of any
+    size fits its 32 bit appetite. Return FALSE when anything fails.
+*/
+    size_t bite, made;
+    z_stream* zip = chn->zip;
+    if (zip == NULL) {
+        return fwrite(data, 1, length, chn->out) == length;
+    }
+    while (length > 0) {
+        bite = length < WRITE_BUFFER_SIZE ? length : WRITE_BUFFER_SIZE;
+        zip->next_in = data;
+        zip->avail_in = (uInt)bite;
+        while (zip->avail_in > 0) {
+            zip->next_out = chn->zip_buffer;
+            zip->avail_out = WRITE_BUFFER_SIZE;
+            if (deflate(zip, Z_NO_FLUSH) != Z_OK) {
+                return FALSE;
+            }
+            made = WRITE_BUFFER_SIZE - zip->avail_out;
+            if (made > 0
+                    && fwrite(chn->zip_buffer, 1, made, chn->out)
+                        != made) {
+                return FALSE;
+            }
+        }
+        data += bite;
+        length -= bite;
+    }
+    return TRUE;
 }
 
 
-static void
-string(int quote, int in_comment)
+static void*
+write_worker(void* arg)
 {
-    int c, was = line_nr;
+/*
+    The writer thread: retire each posted output buffer while the
+    scanner refills the other one.
+*/
+    context* ctx = arg;
+    int ok;
+    pthread_mutex_lock(&ctx->write_lock);
     for (;;) {
-        c = get(TRUE);
-        if (c == quote) {
-            return;
+        while (!ctx->writing && !ctx->write_quit) {
+            pthread_cond_wait(&ctx->write_posted, &ctx->write_lock);
         }
-        if (c == '\\') {
-            c = get(TRUE);
-        }
-        if (in_comment && c == '*' && peek() == '/') {
-            error("unexpected close comment in string.");
+        if (ctx->write_quit) {
+            break;
         }
-        if (c == EOF) {
-            line_nr = was;
-            error("unterminated string literal.");
+        pthread_mutex_unlock(&ctx->write_lock);
+        ok = deliver(ctx->job_chn, ctx->job_data, ctx->job_length);
+        pthread_mutex_lock(&ctx->write_lock);
+        if (!ok) {
+            ctx->write_failed = TRUE;
         }
+        ctx->writing = FALSE;
+        pthread_cond_signal(&ctx->write_taken);
     }
+    pthread_mutex_unlock(&ctx->write_lock);
+    return NULL;
 }
 
 
 static int
-pre_regexp(int left)
+wait_writer(context* ctx)
 {
-    return (left == '(' || left == ',' || left == '=' ||
-            left == ':' || left == '[' || left == '!' ||
-            left == '&' || left == '|' || left == '?' ||
-            left == '{' || left == '}' || left == ';');
+/*
+    Wait until the posted write, if any, is done. Return FALSE if any
+    posted write has failed.
+*/
+    int ok = TRUE;
+    if (ctx->writer_on) {
+        pthread_mutex_lock(&ctx->write_lock);
+        while (ctx->writing) {
+            pthread_cond_wait(&ctx->write_taken, &ctx->write_lock);
+        }
+        ok = !ctx->write_failed;
+        pthread_mutex_unlock(&ctx->write_lock);
+    }
+    return ok;
 }
 
 
 static void
-regexp(int in_comment)
+flush_to(context* ctx, channel* chn)
 {
-    int c, was = line_nr;
-    for (;;) {
-        c = get(TRUE);
-        if (c == '[') {
-            for (;;) {
-                c = get(TRUE);
-                if (c == ']') {
-                    break;
-                }
-                if (c == '\\') {
-                    c = get(TRUE);
-                }
-                if (in_comment && c == '*' && peek() == '/') {
-                    error("unexpected close comment in regexp.");
-                }
-                if (c == EOF) {
-                    error("unterminated set in Regular Expression literal.");
-                }
-            }
-        } else if (c == '/') {
-            if (in_comment && (peek() == '/' || peek() == '*')) {
-                error("unexpected comment.");
-            }
-            return;
-        } else if (c == '\\') {
-            c = get(TRUE);
-        }
-        if (in_comment && c == '*' && peek() == '/') {
-            error("unexpected comment.");
+/*
+    Write a channel's accumulated output in one call. In pipelined mode
+    the full buffer is posted to the writer thread and the channel takes
+    the spare, so the write retires while the scan goes on.
+*/
+    unsigned char* full;
+    if (chn->out_mapped || chn->write_at == 0) {
+        return;
+    }
+    if (ctx->async && !ctx->writer_on) {
+        ctx->write_quit = FALSE;
+        ctx->writing = FALSE;
+        if (pthread_create(&ctx->writer, NULL, write_worker, ctx) == 0) {
+            ctx->writer_on = TRUE;
         }
-        if (c == EOF) {
-            line_nr = was;
-            error("unterminated regexp literal.");
+    }
+    if (!ctx->async || !ctx->writer_on) {
+        if (!deliver(chn, chn->write_buffer, chn->write_at)) {
+            error(ctx, "write error.");
         }
+        chn->written += chn->write_at;
+        chn->write_at = 0;
+        return;
+    }
+    pthread_mutex_lock(&ctx->write_lock);
+    while (ctx->writing) {
+        pthread_cond_wait(&ctx->write_taken, &ctx->write_lock);
     }
+    if (ctx->write_failed) {
+        pthread_mutex_unlock(&ctx->write_lock);
+        error(ctx, "write error.");
+    }
+    full = chn->write_buffer;
+    chn->write_buffer = ctx->spare;
+    chn->heap_buffer = ctx->spare;
+    ctx->spare = full;
+    ctx->job_data = full;
+    ctx->job_length = chn->write_at;
+    ctx->job_chn = chn;
+    ctx->writing = TRUE;
+    pthread_cond_signal(&ctx->write_posted);
+    pthread_mutex_unlock(&ctx->write_lock);
+    chn->written += chn->write_at;
+    chn->write_at = 0;
 }
 
 
 static void
-condition()
+flush(context* ctx)
 {
-    int c, left = '{', paren = 0;
-    for (;;) {
-        c = get(TRUE);
-        if (c == '(' || c == '{' || c == '[') {
-            paren += 1;
-        } else if (c == ')' || c == '}' || c == ']') {
-            paren -= 1;
-            if (paren == 0) {
-                emit(' ');
-                return;
-            }
-        } else if (c == EOF) {
-            error("Unterminated condition.");
-        } else if (c == '\'' || c == '"' || c == '`') {
-            string(c, TRUE);
-        } else if (c == '/') {
-            if (peek() == '/' || peek() == '*') {
-                error("unexpected comment.");
-            }
-            if (pre_regexp(left)) {
-                regexp(TRUE);
-            }
-        } else if (c == '*' && peek() == '/') {
-            error("unclosed condition.");
-        }
-        if (c > ' ') {
-            left = c;
-        }
+    int k;
+    for (k = 0; k < ctx->nr_channels; k += 1) {
+        flush_to(ctx, ctx->channels + k);
     }
 }
 
 
 static void
-stuff()
+emit_to(context* ctx, channel* chn, int c)
 {
-    int c, left = '{', paren = 0;
-    while (peek() == ' ') {
-        get(FALSE);
+/*
+    Append a character to a channel's output buffer.
+*/
+    if (chn->write_at >= chn->write_limit) {
+        if (chn->out_mapped) {
+            error(ctx, "output bound exceeded.");
+        }
+        flush_to(ctx, chn);
     }
-    for (;;) {
-        while (peek() == '*') {
-            get(FALSE);
-            if (peek() == '/') {
-                get(FALSE);
-                if (paren > 0) {
-                    error("Unbalanced stuff");
-                }
-                return;
-            }
-            emit('*');
+    chn->write_buffer[chn->write_at] = (unsigned char)c;
+    chn->write_at += 1;
+}
+
+
+static void
+emit_span_to(context* ctx, channel* chn, unsigned char* from, size_t length)
+{
+/*
+    Append a run of characters to a channel's output buffer in one copy.
+    Runs that are larger than the buffer are written through directly. A
+    mapped output is the destination itself, so everything is one copy.
+*/
+    if (chn->out_mapped) {
+        if (length > chn->write_limit - chn->write_at) {
+            error(ctx, "output bound exceeded.");
         }
-        c = get(TRUE);
-        if (c == EOF) {
-            error("Unterminated stuff.");
-        } else if (c == '\'' || c == '"' || c == '`') {
-            string(c, TRUE);
-        } else if (c == '(' || c == '{' || c == '[') {
-            paren += 1;
-        } else if (c == ')' || c == '}' || c == ']') {
-            paren -= 1;
-            if (paren < 0) {
-                error("Unbalanced stuff");
-            }
-        } else if (c == '/') {
-            if (peek() == '/' || peek() == '*') {
-                error("unexpected comment.");
+        memcpy(chn->write_buffer + chn->write_at, from, length);
+        chn->write_at += length;
+        return;
+    }
+    while (length > WRITE_BUFFER_SIZE - chn->write_at) {
+        flush_to(ctx, chn);
+        if (length >= WRITE_BUFFER_SIZE) {
+/*
+    A run this big is written through directly, after any posted write
+    has retired so the output stays in order.
+*/
+            if (!wait_writer(ctx)) {
+                error(ctx, "write error.");
             }
-            if (pre_regexp(left)) {
-                regexp(TRUE);
+            if (!deliver(chn, from, length)) {
+                error(ctx, "write error.");
             }
-        }
-        if (c > ' ') {
-            left = c;
+            chn->written += length;
+            return;
         }
     }
+    memcpy(chn->write_buffer + chn->write_at, from, length);
+    chn->write_at += length;
 }
 
 
-static void
-expand(int tag_nr)
+static int
+emit(context* ctx, int c)
 {
-    int c;
-
-    c = peek();
-    if (c == '(') {
-        emits("if ");
-        condition();
-        emit(' ');
-    }
-    emit('{');
-    if (methods[tag_nr][0]) {
-        emits(methods[tag_nr]);
-        emit('(');
-        stuff();
-        emits(");}");
-    } else {
-        stuff();
-        emit('}');
+/*
+    Append a character to the output: to the selected channel, or to all
+    of them.
+*/
+    int k;
+    if (c > 0) {
+        if (ctx->only_channel != EOF) {
+            emit_to(ctx, ctx->channels + ctx->only_channel, c);
+        } else {
+            for (k = 0; k < ctx->nr_channels; k += 1) {
+                emit_to(ctx, ctx->channels + k, c);
+            }
+        }
     }
+    return c;
 }
 
 
-static int
-match()
+static void
+emit_span(context* ctx, unsigned char* from, size_t length)
 {
-    int tag_nr;
-
-    for (tag_nr = 0; tag_nr < nr_tags; tag_nr += 1) {
-        if (strcmp(tag, tags[tag_nr]) == 0) {
-            return tag_nr;
+/*
+    Append a run of characters to the output: to the selected channel, or
+    to all of them.
+*/
+    int k;
+    if (ctx->only_channel != EOF) {
+        emit_span_to(ctx, ctx->channels + ctx->only_channel, from, length);
+    } else {
+        for (k = 0; k < ctx->nr_channels; k += 1) {
+            emit_span_to(ctx, ctx->channels + k, from, length);
         }
     }
-    return EOF;
 }
 
 
 static void
-process()
+emits(context* ctx, char* s)
 {
 /*
-    Loop through the program text, looking for patterns.
+    Send a string to the output buffer.
 */
-    int c, i, left = 0;
-    line_nr = 1;
-    c = get(FALSE);
-    for (;;) {
-        if (c == EOF) {
-            break;
-        } else if (c == '\'' || c == '"' || c == '`') {
-            emit(c);
-            string(c, FALSE);
-            c = 0;
+    emit_span(ctx, (unsigned char*)s, strlen(s));
+}
+
+
+static void
+record(context* ctx, unsigned char* from, size_t length)
+{
 /*
-    The most complicated case is the slash. It can mean division or a regexp
-    literal or a line comment or a block comment. A block comment can also be
-    a pattern to be expanded.
+    Append consumed input characters to the capture buffer, growing it as
+    needed. While a fan out context expands a pattern for its first
+    channel, the raw characters are recorded here so that the other
+    channels can be served from memory without rereading the input.
 */
-        } else if (c == '/') {
+    size_t limit = ctx->capture_limit;
+    unsigned char* capture;
+    if (ctx->capture_at + length > limit) {
+        limit = limit == 0 ? 1024 : limit;
+        while (limit < ctx->capture_at + length) {
+            limit *= 2;
+        }
+        capture = realloc(ctx->capture, limit);
+        if (capture == NULL) {
+            error(ctx, "out of memory.");
+        }
+        ctx->capture = capture;
+        ctx->capture_limit = limit;
+    }
+    memcpy(ctx->capture + ctx->capture_at, from, length);
+    ctx->capture_at += length;
+}
+
+
+static int
+fill(context* ctx)
+{
 /*
-    A slash slash comment skips to the end of the file.
+    Refill the input buffer from the byte stream. Return FALSE at end of
+    file.
 */
-            if (peek() == '/') {
-                emit('/');
-                for (;;) {
-                    c = get(TRUE);
-                    if (c == '\n' || c == '\r' || c == EOF) {
-                        break;
-                    }
-                }
-                c = get(FALSE);
+    size_t length;
+    if (ctx->read_eof || ctx->read_mapped) {
+        ctx->read_eof = TRUE;
+        return FALSE;
+    }
+    retire(ctx, ctx->read_limit);
+    length = more(ctx, ctx->read_buffer, READ_BUFFER_SIZE);
+    ctx->read_at = 0;
+    ctx->read_limit = length;
+    if (length == 0) {
+        ctx->read_eof = TRUE;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+static void
+reserve(context* ctx, size_t want)
+{
 /*
-    The first component of a slash star comment might be the tag.
+    Make sure that at least want characters are sitting in the buffer, so
+    that a caller can walk over them and still point back at where it
+    started. The unconsumed tail is moved to the front and the rest of the
+    buffer is refilled. After this, fewer than want characters means the
+    input is nearly over.
 */
-            } else {
-                if (peek() == '*') {
-                    get(FALSE);
-                    for (i = 0; i < MAX_TAG_LENGTH; i += 1) {
-                        c = get(FALSE);
-                        if (!is_alphanum(c)) {
-                            break;
-                        }
-                        tag[i] = (char)c;
-                    }
-                    tag[i] = 0;
-                    unget(c);
+    size_t length, tail;
+    if (ctx->read_mapped || ctx->read_eof
+            || ctx->read_limit - ctx->read_at >= want) {
+        return;
+    }
+    retire(ctx, ctx->read_at);
+    tail = ctx->read_limit - ctx->read_at;
+    memmove(ctx->read_buffer, ctx->read_buffer + ctx->read_at, tail);
+    ctx->read_at = 0;
+    ctx->read_limit = tail;
+    length = more(ctx, ctx->read_buffer + ctx->read_limit,
+        READ_BUFFER_SIZE - ctx->read_limit);
+    if (length == 0) {
+        ctx->read_eof = TRUE;
+    }
+    ctx->read_limit += length;
+}
+
+
+static int
+peek(context* ctx)
+{
 /*
-    Did the tag match something?
+    Return the next character from the input without consuming it.
 */
-                    i = i == 0 ? -1 : match();
-                    if (i >= 0) {
-                        expand(i);
-                        c = get(FALSE);
+    if (ctx->read_at >= ctx->read_limit && !fill(ctx)) {
+        return EOF;
+    }
+    return ctx->read_buffer[ctx->read_at];
+}
+
+
+static int
+get(context* ctx, int echo)
+{
+/*
+    Return the next character from the input. If the echo argument is TRUE,
+    then the character will also be emitted. Line breaks are not examined
+    here: line numbers are derived on demand by line_at().
+*/
+    int c;
+    unsigned char byte;
+    if (ctx->read_at >= ctx->read_limit && !fill(ctx)) {
+        c = EOF;
+    } else {
+        c = ctx->read_buffer[ctx->read_at];
+        ctx->read_at += 1;
+    }
+    if (c <= 0) {
+        return EOF;
+    }
+    if (ctx->recording) {
+        byte = (unsigned char)c;
+        record(ctx, &byte, 1);
+    }
+    if (ctx->stats != NULL) {
+        ctx->stats->bytes += 1;
+    }
+    if (echo) {
+        emit(ctx, c);
+    }
+    return c;
+}
+
+
+static size_t
+find_interesting(unsigned char* from, size_t length)
+{
+/*
+    Return the offset of the next character that the scanner must look at:
+    a quote, a backtick, a slash, or a NUL (which the reader treats as end
+    of file). Everything in front of it is plain text that can be echoed in
+    one span. With SSE2 the text is examined sixteen characters at a time;
+    a plain loop takes care of the remainder and of other machines.
+*/
+    size_t at = 0;
+#if defined(__SSSE3__)
+/*
+    The vector kernel classifies sixteen characters with two nibble
+    table lookups instead of five equality comparisons. Each table row
+    holds a bit per high nibble that an interesting character can have:
+    NUL and the backtick share low nibble 0, and the quotes and the
+    slash share high nibble 2. A character is interesting when the bits
+    of its two nibbles intersect, which is exactly the CLASS_INTERESTING
+    row of class_of.
+*/
+    __m128i lows = _mm_setr_epi8(
+        5, 0, 2, 0, 0, 0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 2);
+    __m128i highs = _mm_setr_epi8(
+        1, 0, 2, 0, 0, 0, 4, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    __m128i fifteen = _mm_set1_epi8(0x0F);
+    __m128i nothing = _mm_set1_epi8(0);
+    while (at + 16 <= length) {
+        __m128i chunk = _mm_loadu_si128((__m128i const*)(from + at));
+        __m128i low = _mm_shuffle_epi8(lows,
+            _mm_and_si128(chunk, fifteen));
+        __m128i high = _mm_shuffle_epi8(highs,
+            _mm_and_si128(_mm_srli_epi16(chunk, 4), fifteen));
+        int mask = _mm_movemask_epi8(
+            _mm_cmpgt_epi8(_mm_and_si128(low, high), nothing));
+        if (mask != 0) {
+            return at + (size_t)__builtin_ctz((unsigned)mask);
+        }
+        at += 16;
+    }
+#elif defined(__SSE2__)
+    __m128i single = _mm_set1_epi8('\'');
+    __m128i twin   = _mm_set1_epi8('"');
+    __m128i tick   = _mm_set1_epi8('`');
+    __m128i slash  = _mm_set1_epi8('/');
+    __m128i zero   = _mm_set1_epi8(0);
+    while (at + 16 <= length) {
+        __m128i chunk = _mm_loadu_si128((__m128i const*)(from + at));
+        __m128i hit = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, single),
+                         _mm_cmpeq_epi8(chunk, twin)),
+            _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(chunk, tick),
+                             _mm_cmpeq_epi8(chunk, slash)),
+                _mm_cmpeq_epi8(chunk, zero)));
+        int mask = _mm_movemask_epi8(hit);
+        if (mask != 0) {
+            return at + (size_t)__builtin_ctz((unsigned)mask);
+        }
+        at += 16;
+    }
+#endif
+    while (at < length) {
+        if (class_of[from[at]] & CLASS_INTERESTING) {
+            break;
+        }
+        at += 1;
+    }
+    return at;
+}
+
+
+static size_t
+find_byte(unsigned char* from, size_t length, int w, int x, int y, int z)
+{
+/*
+    Return the offset of the first occurrence of one of four caller chosen
+    characters, or of a NUL, in a span. A caller that cares about fewer
+    than four characters passes duplicates. This is the bulk skip behind
+    the string, regexp, and line comment scanners.
+*/
+    size_t at = 0;
+#if defined(__SSE2__)
+    __m128i ww = _mm_set1_epi8((char)w);
+    __m128i xx = _mm_set1_epi8((char)x);
+    __m128i yy = _mm_set1_epi8((char)y);
+    __m128i zz = _mm_set1_epi8((char)z);
+    __m128i zero = _mm_set1_epi8(0);
+    while (at + 16 <= length) {
+        __m128i chunk = _mm_loadu_si128((__m128i const*)(from + at));
+        __m128i hit = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, ww),
+                         _mm_cmpeq_epi8(chunk, xx)),
+            _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(chunk, yy),
+                             _mm_cmpeq_epi8(chunk, zz)),
+                _mm_cmpeq_epi8(chunk, zero)));
+        int mask = _mm_movemask_epi8(hit);
+        if (mask != 0) {
+            return at + (size_t)__builtin_ctz((unsigned)mask);
+        }
+        at += 16;
+    }
+#endif
+    while (at < length) {
+        int c = from[at];
+        if (c == w || c == x || c == y || c == z || c == 0) {
+            break;
+        }
+        at += 1;
+    }
+    return at;
+}
+
+
+static void
+skip_to(context* ctx, int w, int x, int y, int z)
+{
+/*
+    Echo everything in front of the next occurrence of one of the caller's
+    characters as a single span.
+*/
+    size_t length = find_byte(ctx->read_buffer + ctx->read_at,
+        ctx->read_limit - ctx->read_at, w, x, y, z);
+    if (length > 0) {
+        if (ctx->recording) {
+            record(ctx, ctx->read_buffer + ctx->read_at, length);
+        }
+        if (ctx->stats != NULL) {
+            ctx->stats->bytes += length;
+            ctx->stats->literal_bytes += length;
+        }
+        emit_span(ctx, ctx->read_buffer + ctx->read_at, length);
+        ctx->read_at += length;
+    }
+}
+
+
+static void
+string(context* ctx, int quote, int in_comment)
+{
+    int c;
+    ctx->mark = ctx->base + ctx->read_at;
+    ctx->mark_line = 0;
+    for (;;) {
+        skip_to(ctx, quote, '\\', in_comment ? '*' : quote, quote);
+        c = get(ctx, TRUE);
+        if (c == quote) {
+            return;
+        }
+        if (c == '\\') {
+            c = get(ctx, TRUE);
+        }
+        if (in_comment && c == '*' && peek(ctx) == '/') {
+            error(ctx, "unexpected close comment in string.");
+        }
+        if (c == EOF) {
+            error_at_mark(ctx, "unterminated string literal.");
+        }
+    }
+}
+
+
+static int
+pre_regexp(int left)
+{
+/*
+    May a slash to the right of this character begin a regexp literal?
+*/
+    return (class_of[left & 0xFF] & CLASS_PRE_REGEXP) != 0;
+}
+
+
+static void
+regexp(context* ctx, int in_comment)
+{
+    int c;
+    ctx->mark = ctx->base + ctx->read_at;
+    ctx->mark_line = 0;
+    for (;;) {
+        skip_to(ctx, '[', '/', '\\', in_comment ? '*' : '/');
+        c = get(ctx, TRUE);
+        if (c == '[') {
+            for (;;) {
+                skip_to(ctx, ']', '\\', in_comment ? '*' : ']', ']');
+                c = get(ctx, TRUE);
+                if (c == ']') {
+                    break;
+                }
+                if (c == '\\') {
+                    c = get(ctx, TRUE);
+                }
+                if (in_comment && c == '*' && peek(ctx) == '/') {
+                    error(ctx, "unexpected close comment in regexp.");
+                }
+                if (c == EOF) {
+                    error(ctx,
+                        "unterminated set in Regular Expression literal.");
+                }
+            }
+        } else if (c == '/') {
+            if (in_comment && (peek(ctx) == '/' || peek(ctx) == '*')) {
+                error(ctx, "unexpected comment.");
+            }
+            return;
+        } else if (c == '\\') {
+            c = get(ctx, TRUE);
+        }
+        if (in_comment && c == '*' && peek(ctx) == '/') {
+            error(ctx, "unexpected comment.");
+        }
+        if (c == EOF) {
+            error_at_mark(ctx, "unterminated regexp literal.");
+        }
+    }
+}
+
+
+static void
+condition(context* ctx)
+{
+    int c, left = '{', paren = 0;
+    for (;;) {
+        c = get(ctx, TRUE);
+        if (c == '(' || c == '{' || c == '[') {
+            paren += 1;
+        } else if (c == ')' || c == '}' || c == ']') {
+            paren -= 1;
+            if (paren == 0) {
+                emit(ctx, ' ');
+                return;
+            }
+        } else if (c == EOF) {
+            error(ctx, "Unterminated condition.");
+        } else if (c == '\'' || c == '"' || c == '`') {
+            string(ctx, c, TRUE);
+        } else if (c == '/') {
+            if (peek(ctx) == '/' || peek(ctx) == '*') {
+                error(ctx, "unexpected comment.");
+            }
+            if (pre_regexp(left)) {
+                regexp(ctx, TRUE);
+            }
+        } else if (c == '*' && peek(ctx) == '/') {
+            error(ctx, "unclosed condition.");
+        }
+        if (c > ' ') {
+            left = c;
+        }
+    }
+}
+
+
+static void
+stuff(context* ctx)
+{
+    int c, left = '{', paren = 0;
+    while (peek(ctx) == ' ') {
+        get(ctx, FALSE);
+    }
+    for (;;) {
+        while (peek(ctx) == '*') {
+            get(ctx, FALSE);
+            if (peek(ctx) == '/') {
+                get(ctx, FALSE);
+                if (paren > 0) {
+                    error(ctx, "Unbalanced stuff");
+                }
+                return;
+            }
+            emit(ctx, '*');
+        }
+        c = get(ctx, TRUE);
+        if (c == EOF) {
+            error(ctx, "Unterminated stuff.");
+        } else if (c == '\'' || c == '"' || c == '`') {
+            string(ctx, c, TRUE);
+        } else if (c == '(' || c == '{' || c == '[') {
+            paren += 1;
+        } else if (c == ')' || c == '}' || c == ']') {
+            paren -= 1;
+            if (paren < 0) {
+                error(ctx, "Unbalanced stuff");
+            }
+        } else if (c == '/') {
+            if (peek(ctx) == '/' || peek(ctx) == '*') {
+                error(ctx, "unexpected comment.");
+            }
+            if (pre_regexp(left)) {
+                regexp(ctx, TRUE);
+            }
+        }
+        if (c > ' ') {
+            left = c;
+        }
+    }
+}
+
+
+static void
+expand(context* ctx, channel* chn, int tag_nr)
+{
+/*
+    Replace one matched pattern with the tag's precomputed scaffolding:
+    one prefix write, the stuff, one suffix write.
+*/
+    int c;
+
+    c = peek(ctx);
+    if (c == '(') {
+        emits(ctx, "if ");
+        condition(ctx);
+        emit(ctx, ' ');
+    }
+    emits(ctx, chn->set->prefixes[tag_nr]);
+    stuff(ctx);
+    emits(ctx, chn->set->suffixes[tag_nr]);
+}
+
+
+static int
+channel_tag(channel* chn, int tag)
+{
+/*
+    Map a scan trie tag number, one based, to the channel's own tag number
+    plus one, or zero when the channel does not declare the tag.
+*/
+    return chn->tag_of == NULL ? tag : chn->tag_of[tag - 1];
+}
+
+
+static void
+fan_out(context* ctx, int tag, unsigned char* text, size_t count)
+{
+/*
+    Expand one matched pattern for every channel in a single pass over the
+    input. The first channel that declares the tag scans the comment live
+    while get() and skip_to() record the consumed characters. The other
+    declaring channels replay the recording through their own expansion,
+    and the channels that do not declare the tag get the comment echoed
+    verbatim, which is what a lone run with their tag set would have done.
+    The replays run over memory that the live pass already validated and
+    counted, so their line bookkeeping is thrown away.
+*/
+    int eof, first = 0, k, local, mapped;
+    size_t at, limit;
+    unsigned char* buffer;
+    unsigned char* word = ctx->tag_word;
+
+    memcpy(word, text, count);
+    while (channel_tag(ctx->channels + first, tag) == 0) {
+        first += 1;
+    }
+    ctx->capture_at = 0;
+    ctx->recording = TRUE;
+    ctx->only_channel = first;
+    expand(ctx, ctx->channels + first,
+        channel_tag(ctx->channels + first, tag) - 1);
+    ctx->recording = FALSE;
+    for (k = 0; k < ctx->nr_channels; k += 1) {
+        if (k == first) {
+            continue;
+        }
+        ctx->only_channel = k;
+        local = channel_tag(ctx->channels + k, tag);
+        if (local == 0) {
+            if (ctx->strip == 0) {
+                emits(ctx, "/*");
+                emit_span(ctx, word, count);
+                emit_span(ctx, ctx->capture, ctx->capture_at);
+            }
+        } else {
+            buffer = ctx->read_buffer;
+            at = ctx->read_at;
+            limit = ctx->read_limit;
+            eof = ctx->read_eof;
+            mapped = ctx->read_mapped;
+            ctx->read_buffer = ctx->capture;
+            ctx->read_at = 0;
+            ctx->read_limit = ctx->capture_at;
+            ctx->read_mapped = TRUE;
+            expand(ctx, ctx->channels + k, local - 1);
+            ctx->read_buffer = buffer;
+            ctx->read_at = at;
+            ctx->read_limit = limit;
+            ctx->read_eof = eof;
+            ctx->read_mapped = mapped;
+        }
+    }
+    ctx->only_channel = EOF;
+}
+
+
+static void
+index_span(context* ctx, size_t in_at, size_t out_at)
+{
+/*
+    Append one record to the expansion span index: where the rewritten
+    region was in the input, and where its replacement went in the
+    output. The starting positions were captured before the expansion;
+    the lengths run to the scanner's and the channel's current
+    positions.
+*/
+    unsigned long long record[4];
+    channel* chn = ctx->channels;
+    record[0] = (unsigned long long)in_at;
+    record[1] = (unsigned long long)(ctx->base + ctx->read_at - in_at);
+    record[2] = (unsigned long long)out_at;
+    record[3] = (unsigned long long)(chn->written + chn->write_at - out_at);
+    if (fwrite(record, sizeof record, 1, ctx->index) != 1) {
+        error(ctx, "index write error.");
+    }
+    ctx->indexed = TRUE;
+}
+
+
+static void
+process(context* ctx)
+{
+/*
+    Loop through the program text, looking for patterns.
+*/
+    int c, count, i, keep, left = 0, node, symbol;
+    double started = 0.0, then = 0.0;
+    size_t back, in_at = 0, length, out_at = 0, start;
+    unsigned char* span;
+    jsdev* set = ctx->set;
+    ctx->line_nr = 1;
+    if (ctx->stats != NULL) {
+        started = seconds();
+    }
+    c = get(ctx, FALSE);
+    for (;;) {
+        if (c == EOF) {
+            break;
+        } else if (class_of[c] & CLASS_STRING) {
+            emit(ctx, c);
+            if (ctx->stats == NULL) {
+                string(ctx, c, FALSE);
+            } else {
+                then = seconds();
+                string(ctx, c, FALSE);
+                ctx->stats->string_seconds += seconds() - then;
+            }
+            c = 0;
+/*
+    The most complicated case is the slash. It can mean division or a regexp
+    literal or a line comment or a block comment. A block comment can also be
+    a pattern to be expanded.
+*/
+        } else if (c == '/') {
+/*
+    A slash slash comment skips to the end of the file.
+*/
+            if (peek(ctx) == '/') {
+                keep = ctx->strip < 2;
+                if (ctx->index != NULL && ctx->nr_channels == 1
+                        && !keep) {
+                    in_at = ctx->base + ctx->read_at - 1;
+                    out_at = ctx->channels->written
+                        + ctx->channels->write_at;
+                }
+                if (keep) {
+                    emit(ctx, '/');
+                }
+                if (ctx->stats != NULL) {
+                    ctx->stats->comments += 1;
+                }
+                for (;;) {
+                    length = find_byte(ctx->read_buffer + ctx->read_at,
+                        ctx->read_limit - ctx->read_at,
+                        '\n', '\r', '\n', '\r');
+                    if (length > 0) {
+                        if (ctx->stats != NULL) {
+                            ctx->stats->bytes += length;
+                        }
+                        if (keep) {
+                            emit_span(ctx,
+                                ctx->read_buffer + ctx->read_at, length);
+                        }
+                        ctx->read_at += length;
+                    }
+                    c = get(ctx, keep);
+                    if (c == '\n' || c == '\r' || c == EOF) {
+                        break;
+                    }
+                }
+                if (!keep) {
+/*
+    The line break that ended the stripped comment is kept, and the
+    index span swallows the comment and replaces it with that break.
+*/
+                    if (c != EOF) {
+                        emit(ctx, c);
+                    }
+                    if (ctx->index != NULL && ctx->nr_channels == 1) {
+                        index_span(ctx, in_at, out_at);
+                    }
+                }
+                c = get(ctx, FALSE);
+/*
+    The first component of a slash star comment might be the tag.
+*/
+            } else {
+                if (peek(ctx) == '*') {
+                    get(ctx, FALSE);
+                    if (ctx->stats != NULL) {
+                        ctx->stats->comments += 1;
+                    }
+/*
+    Walk the comment's first word through the tag trie. reserve()
+    guarantees that the walked characters stay in the buffer, so nothing
+    is copied: a miss is re-emitted as a span straight from the buffer.
+    Most undeclared tags fall out of the trie on the first character.
+*/
+                    reserve(ctx, (size_t)set->longest_tag + 2);
+                    start = ctx->read_at;
+                    node = 0;
+                    count = 0;
+                    while (count <= set->longest_tag) {
+                        c = peek(ctx);
+                        symbol = c <= 0 ? EOF : set->symbol_of[c];
+                        if (symbol < 0) {
+                            break;
+                        }
+                        node = set->trie_child[node][symbol];
+                        get(ctx, FALSE);
+                        count += 1;
+                        if (node == 0) {
+                            break;
+                        }
+                    }
+/*
+    Did the tag match something?
+*/
+                    i = node == 0 || count == 0 ? 0 : set->trie_tag[node];
+                    if (i != 0) {
+                        if (ctx->index != NULL && ctx->nr_channels == 1) {
+                            in_at = ctx->base + start - 2;
+                            out_at = ctx->channels->written
+                                + ctx->channels->write_at;
+                        }
+                        if (ctx->stats != NULL) {
+                            ctx->stats->matches += 1;
+                            if (ctx->stats->tag_matches != NULL) {
+                                ctx->stats->tag_matches[i - 1] += 1;
+                            }
+                            then = seconds();
+                        }
+                        if (ctx->nr_channels == 1) {
+/*
+    The scan trie's numbering is the channel's own except in a fan out
+    context, whose merged set deduplicates repeated tag names; map the
+    tag down to the channel before expanding.
+*/
+                            expand(ctx, ctx->channels,
+                                channel_tag(ctx->channels, i) - 1);
+                        } else {
+                            fan_out(ctx, i, ctx->read_buffer + start,
+                                (size_t)count);
+                        }
+                        if (ctx->stats != NULL) {
+                            ctx->stats->expand_seconds += seconds() - then;
+                        }
+                        if (ctx->index != NULL && ctx->nr_channels == 1) {
+                            index_span(ctx, in_at, out_at);
+                        }
+                        c = get(ctx, FALSE);
                     } else {
 /*
-    If the tag didn't match, then echo the comment.
+    If the tag didn't match, then echo the comment, unless the strip
+    mode drops it: a first word that walked into the trie has a
+    pattern's shape, so level one strips the comment, and level two
+    strips every comment.
+*/
+                        keep = ctx->strip == 0
+                            || (ctx->strip == 1 && count == 0);
+                        if (ctx->index != NULL && ctx->nr_channels == 1
+                                && !keep) {
+                            in_at = ctx->base + start - 2;
+                            out_at = ctx->channels->written
+                                + ctx->channels->write_at;
+                        }
+                        if (keep) {
+                            emits(ctx, "/*");
+                            emit_span(ctx, ctx->read_buffer + start,
+                                (size_t)count);
+                        }
+                        c = peek(ctx);
+                        if (c <= 0) {
+                            c = EOF;
+                        }
+                        for (;;) {
+                            if (c == EOF) {
+                                error(ctx, "unterminated comment.");
+                            }
+                            if (c == '/') {
+                                c = get(ctx, keep);
+                                if (c == '*' || c == '/') {
+                                    error(ctx, "nested comment.");
+                                }
+                            } else if (c == '*') {
+                                c = get(ctx, keep);
+                                if (c == '/') {
+                                    break;
+                                }
+                            } else {
+                                c = get(ctx, keep);
+                            }
+                        }
+                        if (ctx->index != NULL && ctx->nr_channels == 1
+                                && !keep) {
+                            index_span(ctx, in_at, out_at);
+                        }
+                        c = get(ctx, FALSE);
+                    }
+                } else {
+                    emit(ctx, '/');
+/*
+    We are looking at a single slash. Is it a division operator, or is it the
+    start of a regexp literal? If is not possible to tell for sure without doing
+    a complete parse of the program, and we are not going to do that. Instead,
+    we are adopting the convention that a regexp literal must have one of a
+    small set of characters to its left.
+*/
+                    if (pre_regexp(left)) {
+                        if (ctx->stats == NULL) {
+                            regexp(ctx, FALSE);
+                        } else {
+                            then = seconds();
+                            regexp(ctx, FALSE);
+                            ctx->stats->regexp_seconds += seconds() - then;
+                        }
+                    }
+                    left = '/';
+                    c = get(ctx, FALSE);
+                }
+            }
+        } else {
+/*
+    The character was nothing special, to just echo it.
+    If it wasn't whitespace, remember it as the character to the left of the
+    next character. Then echo the whole plain run in front of the next
+    interesting character as one span instead of going around this loop
+    once per character.
+*/
+            emit(ctx, c);
+            if (c > ' ') {
+                left = c;
+            }
+            length = find_interesting(ctx->read_buffer + ctx->read_at,
+                ctx->read_limit - ctx->read_at);
+            if (length > 0) {
+                if (ctx->stats != NULL) {
+                    ctx->stats->bytes += length;
+                }
+                span = ctx->read_buffer + ctx->read_at;
+                emit_span(ctx, span, length);
+                back = length;
+                while (back > 0) {
+                    if (!(class_of[span[back - 1]] & CLASS_WHITESPACE)) {
+                        left = span[back - 1];
+                        break;
+                    }
+                    back -= 1;
+                }
+                ctx->read_at += length;
+            }
+            c = get(ctx, FALSE);
+        }
+    }
+    if (ctx->stats != NULL) {
+        ctx->stats->process_seconds += seconds() - started;
+        ctx->stats->lines += (unsigned long long)line_at(ctx, ctx->read_at);
+    }
+}
+
+
+static void
+preface(context* ctx)
+{
+/*
+    Write each channel's comment lines ahead of the program text.
+*/
+    int i, k;
+    jsdev* set;
+    for (k = 0; k < ctx->nr_channels; k += 1) {
+        set = ctx->channels[k].set;
+        ctx->only_channel = k;
+        for (i = 0; i < set->nr_comments; i += 1) {
+            emits(ctx, "// ");
+            emits(ctx, set->comments[i]);
+            emit(ctx, '\n');
+        }
+    }
+    ctx->only_channel = EOF;
+}
+
+
+static void
+transform(context* ctx)
+{
+/*
+    Run the whole transformation over the context's input: each channel's
+    comment lines, then the program text.
+*/
+    preface(ctx);
+    process(ctx);
+}
+
+
+static int
+expandable(jsdev* set, unsigned char* data, size_t length)
+{
+/*
+    Could anything in the span expand? Only a slashstar whose next
+    character can begin a declared tag can, so a span without one - the
+    usual shape of a vendored or minified library - does not need the
+    scanner at all. A NUL, which the scanner treats as end of file, also
+    counts as interesting so that such a file keeps its old treatment.
+*/
+    int c, symbol;
+    size_t at = 0;
+    for (;;) {
+        at += find_byte(data + at, length - at, '/', '/', '/', '/');
+        if (at >= length) {
+            return FALSE;
+        }
+        if (data[at] == 0) {
+            return TRUE;
+        }
+        if (at + 2 < length && data[at + 1] == '*') {
+            c = data[at + 2];
+            symbol = set->symbol_of[c];
+            if (symbol >= 0 && set->trie_child[0][symbol] != 0) {
+                return TRUE;
+            }
+        }
+        at += 1;
+    }
+}
+
+
+static void
+begin(context* ctx, FILE* out)
+{
+/*
+    Reset the scanner state for a fresh input.
+*/
+    int k;
+    ctx->path = NULL;
+    ctx->cr = FALSE;
+    ctx->line_nr = 0;
+    ctx->counted_lines = 0;
+    ctx->base = 0;
+    ctx->mark = 0;
+    ctx->mark_line = 0;
+    ctx->read_at = 0;
+    ctx->read_limit = 0;
+    ctx->read_eof = FALSE;
+    ctx->read_mapped = FALSE;
+    ctx->map = NULL;
+    ctx->in = NULL;
+    ctx->read_buffer = ctx->stream_buffer;
+    ctx->only_channel = EOF;
+    ctx->recording = FALSE;
+    ctx->capture_at = 0;
+    for (k = 0; k < ctx->nr_channels; k += 1) {
+        ctx->channels[k].write_at = 0;
+        ctx->channels[k].written = 0;
+    }
+    ctx->indexed = FALSE;
+    ctx->channels[0].out = out;
+    ctx->write_failed = FALSE;
+    ctx->error_message = NULL;
+}
+
+
+static void
+finish(context* ctx)
+{
+/*
+    Wind down the pipeline at the end of a successful scan: the prefetch
+    thread is joined, the last posted write must have landed, and each
+    gzip encoder coughs up its trailer and is reset for the next input.
+*/
+    int k, result;
+    size_t made;
+    channel* chn;
+    z_stream* zip;
+    stop_reader(ctx);
+    if (!wait_writer(ctx)) {
+        error(ctx, "write error.");
+    }
+    for (k = 0; k < ctx->nr_channels; k += 1) {
+        chn = ctx->channels + k;
+        zip = chn->zip;
+        if (zip == NULL) {
+            continue;
+        }
+        zip->next_in = NULL;
+        zip->avail_in = 0;
+        do {
+            zip->next_out = chn->zip_buffer;
+            zip->avail_out = WRITE_BUFFER_SIZE;
+            result = deflate(zip, Z_FINISH);
+            if (result != Z_OK && result != Z_STREAM_END) {
+                error(ctx, "write error.");
+            }
+            made = WRITE_BUFFER_SIZE - zip->avail_out;
+            if (made > 0
+                    && fwrite(chn->zip_buffer, 1, made, chn->out)
+                        != made) {
+                error(ctx, "write error.");
+            }
+        } while (result != Z_STREAM_END);
+        deflateReset(zip);
+    }
+}
+
+
+static void
+map_outputs(context* ctx)
+{
+/*
+    With the outmap mode on and the input mapped, give each channel
+    whose output is a regular file a preallocated mapping to write into:
+    the file is extended to a bound the result cannot exceed - the input
+    plus the comment lines plus a generous allowance per possible
+    expansion - and truncated back to the real length when the scan
+    settles. Every emit then lands in the destination pages directly,
+    with no write on the hot path. An output that cannot be mapped just
+    keeps its buffer.
+*/
+    int file, i, k;
+    size_t bound, extra, length;
+    struct stat status;
+    void* wmap;
+    channel* chn;
+    jsdev* set;
+
+    if (!ctx->outmap || !ctx->read_mapped) {
+        return;
+    }
+    for (k = 0; k < ctx->nr_channels; k += 1) {
+        chn = ctx->channels + k;
+        set = chn->set;
+        if (chn->out == NULL || chn->zip != NULL) {
+            continue;
+        }
+        file = fileno(chn->out);
+        if (file < 0 || fstat(file, &status) != 0
+                || !S_ISREG(status.st_mode)) {
+            continue;
+        }
+        extra = 8;
+        for (i = 0; i < set->nr_tags; i += 1) {
+            length = strlen(set->methods[i]) + 8;
+            if (length > extra) {
+                extra = length;
+            }
+        }
+        bound = ctx->map_length + (ctx->map_length / 5 + 1) * extra + 16;
+        for (i = 0; i < set->nr_comments; i += 1) {
+            bound += strlen(set->comments[i]) + 4;
+        }
+        fflush(chn->out);
+        if (ftruncate(file, (off_t)bound) != 0) {
+            continue;
+        }
+        wmap = mmap(NULL, bound, PROT_READ | PROT_WRITE, MAP_SHARED,
+            file, 0);
+        if (wmap == MAP_FAILED) {
+            ftruncate(file, 0);
+            continue;
+        }
+        chn->write_buffer = wmap;
+        chn->write_limit = bound;
+        chn->out_mapped = TRUE;
+    }
+}
+
+
+static void
+settle_outputs(context* ctx)
+{
+/*
+    Give each mapped output channel its buffer back, truncating the file
+    to what was actually written.
+*/
+    int k;
+    channel* chn;
+    for (k = 0; k < ctx->nr_channels; k += 1) {
+        chn = ctx->channels + k;
+        if (!chn->out_mapped) {
+            continue;
+        }
+        munmap(chn->write_buffer, chn->write_limit);
+        if (chn->out != NULL) {
+            ftruncate(fileno(chn->out), (off_t)chn->write_at);
+        }
+        chn->write_buffer = chn->heap_buffer;
+        chn->write_limit = WRITE_BUFFER_SIZE;
+        chn->write_at = 0;
+        chn->out_mapped = FALSE;
+    }
+}
+
+
+static void
+settle_index(context* ctx, size_t in_length)
+{
+/*
+    Close out one input's expansion index with its summary record, whose
+    zero second number tells it apart from a span: the total input
+    length, zero, the total output length, and whether the output
+    differs from the input at all. A scan that recorded no spans and
+    wrote no comment lines echoed every byte, so a downstream tool can
+    skip the file entirely.
+*/
+    unsigned long long record[4];
+    channel* chn = ctx->channels;
+    if (ctx->index == NULL || ctx->nr_channels != 1) {
+        return;
+    }
+    record[0] = (unsigned long long)in_length;
+    record[1] = 0;
+    record[2] = (unsigned long long)(chn->written + chn->write_at);
+    record[3] = ctx->indexed || chn->set->nr_comments > 0 ? 1 : 0;
+    if (fwrite(record, sizeof record, 1, ctx->index) != 1) {
+        error(ctx, "index write error.");
+    }
+}
+
+
+static void
+release(context* ctx)
+{
+/*
+    Let go of whatever input the context was holding. The out streams
+    belong to the caller and are left alone.
+*/
+    int k;
+    stop_reader(ctx);
+    wait_writer(ctx);
+    settle_outputs(ctx);
+    for (k = 0; k < ctx->nr_channels; k += 1) {
+        if (ctx->channels[k].zip != NULL) {
+            deflateReset(ctx->channels[k].zip);
+        }
+    }
+    if (ctx->map != NULL) {
+        munmap(ctx->map, ctx->map_length);
+        ctx->map = NULL;
+    }
+    if (ctx->in != NULL) {
+        fclose(ctx->in);
+        ctx->in = NULL;
+    }
+    for (k = 0; k < ctx->nr_channels; k += 1) {
+        ctx->channels[k].out = NULL;
+    }
+}
+
+
+static unsigned long long
+fnv(unsigned long long hash, unsigned char* data, size_t length)
+{
+/*
+    Fold a run of bytes into a Fowler/Noll/Vo 64 bit hash.
+*/
+    size_t at;
+    for (at = 0; at < length; at += 1) {
+        hash ^= data[at];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+
+static void
+index_tags(jsdev* set)
+{
+/*
+    Compile the declared tags into the trie. This runs once, when the tag
+    set is made. The scanner advances through the trie as it reads a
+    comment, so most undeclared tags are rejected on their first character
+    without any copying or comparing. The first declaration of a duplicate
+    tag wins.
+*/
+    int next, node, symbol, tag_nr;
+    size_t chars = 0, length;
+    char* name;
+
+    next = 0;
+    memset(set->symbol_of, EOF, sizeof set->symbol_of);
+    for (symbol = 0; symbol < 256; symbol += 1) {
+        if (is_alphanum(symbol)) {
+            set->symbol_of[symbol] = (signed char)next;
+            next += 1;
+        }
+    }
+    for (tag_nr = 0; tag_nr < set->nr_tags; tag_nr += 1) {
+        length = strlen(set->tags[tag_nr]);
+        chars += length;
+        if ((int)length > set->longest_tag) {
+            set->longest_tag = (int)length;
+        }
+    }
+    set->trie_child = calloc(chars + 1, sizeof *set->trie_child);
+    set->trie_tag = calloc(chars + 1, sizeof *set->trie_tag);
+    if (set->trie_child == NULL || set->trie_tag == NULL) {
+        return;
+    }
+    set->nr_nodes = 1;
+    for (tag_nr = 0; tag_nr < set->nr_tags; tag_nr += 1) {
+        node = 0;
+        for (name = set->tags[tag_nr]; *name; name += 1) {
+            symbol = set->symbol_of[(unsigned char)*name];
+            next = set->trie_child[node][symbol];
+            if (next == 0) {
+                next = set->nr_nodes;
+                set->nr_nodes += 1;
+                set->trie_child[node][symbol] = next;
+            }
+            node = next;
+        }
+        if (set->trie_tag[node] == 0) {
+            set->trie_tag[node] = tag_nr + 1;
+        }
+    }
+}
+
+
+static char*
+intern(char** strings, int nr, char* text, size_t length,
+    char* arena, size_t* arena_at)
+{
+/*
+    Return a stored copy of the text: an earlier identical string when
+    there is one, otherwise a fresh copy appended to the arena.
+    Namespaced tag schemes repeat long prefixes and share a few methods,
+    so interning keeps the table's cache footprint small.
+*/
+    int i;
+    char* copy;
+    for (i = 0; i < nr; i += 1) {
+        if (strncmp(strings[i], text, length) == 0
+                && strings[i][length] == 0) {
+            return strings[i];
+        }
+    }
+    copy = arena + *arena_at;
+    memcpy(copy, text, length);
+    copy[length] = 0;
+    *arena_at += length + 1;
+    return copy;
+}
+
+
+static size_t
+split_name(char* name, size_t* tag_length, size_t* method_length)
+{
+/*
+    Measure a method line name's tag and optional method, returning the
+    offset where the method starts. A zero tag length, a zero method
+    length after a colon, or trailing junk marks the name bad, reported
+    by returning with *tag_length zero.
+*/
+    int c;
+    size_t at = 0;
+    *tag_length = 0;
+    *method_length = 0;
+    while (is_alphanum((unsigned char)name[at])) {
+        at += 1;
+    }
+    c = name[at];
+    if (at == 0 || (c != 0 && c != ':')) {
+        return at;
+    }
+    *tag_length = at;
+    if (c == ':') {
+        at += 1;
+        while (is_alphanum((unsigned char)name[at + *method_length])) {
+            *method_length += 1;
+        }
+        if (*method_length == 0 || name[at + *method_length] != 0) {
+            *tag_length = 0;
+        }
+    }
+    return at;
+}
+
+
+extern jsdev*
+jsdev_make(int nr_names, char** names,
+    int nr_comments, char** comments, int* bad_name)
+{
+/*
+    Compile a tag set from method line names. Each name is a tag,
+    optionally followed by a colon and a method. The names are interned
+    into one arena, so the number of tags and their lengths are bounded
+    only by memory.
+*/
+    int i, j;
+    size_t arena_at = 0, chars = 0, method_at, method_length, tag_length;
+    jsdev* set;
+
+    if (bad_name != NULL) {
+        *bad_name = EOF;
+    }
+    set = calloc(1, sizeof (jsdev));
+    if (set == NULL) {
+        return NULL;
+    }
+/*
+    Check every name and measure the arena before allocating anything
+    else, so a bad name is cheap to report.
+*/
+    for (i = 0; i < nr_names; i += 1) {
+        split_name(names[i], &tag_length, &method_length);
+        if (tag_length == 0) {
+            if (bad_name != NULL) {
+                *bad_name = i;
+            }
+            free(set);
+            return NULL;
+        }
+        chars += tag_length + 2 * method_length + 5;
+    }
+    set->tags = malloc((nr_names == 0 ? 1 : (size_t)nr_names)
+        * sizeof (char*));
+    set->methods = malloc((nr_names == 0 ? 1 : (size_t)nr_names)
+        * sizeof (char*));
+    set->prefixes = malloc((nr_names == 0 ? 1 : (size_t)nr_names)
+        * sizeof (char*));
+    set->suffixes = malloc((nr_names == 0 ? 1 : (size_t)nr_names)
+        * sizeof (char*));
+    set->arena = malloc(chars + 1);
+    if (set->tags == NULL || set->methods == NULL || set->prefixes == NULL
+            || set->suffixes == NULL || set->arena == NULL) {
+        jsdev_free(set);
+        return NULL;
+    }
+    for (i = 0; i < nr_names; i += 1) {
+        method_at = split_name(names[i], &tag_length, &method_length);
+        set->tags[i] = intern(set->tags, i, names[i], tag_length,
+            set->arena, &arena_at);
+        set->methods[i] = intern(set->methods, i, names[i] + method_at,
+            method_length, set->arena, &arena_at);
+/*
+    Precompute the expansion scaffolding around the stuff, so expand()
+    writes it as one prefix and one suffix instead of rebuilding it for
+    every occurrence. Tags sharing an interned method share the prefix.
+*/
+        if (method_length == 0) {
+            set->prefixes[i] = "{";
+            set->suffixes[i] = "}";
+        } else {
+            for (j = 0; j < i; j += 1) {
+                if (set->methods[j] == set->methods[i]) {
+                    break;
+                }
+            }
+            if (j < i) {
+                set->prefixes[i] = set->prefixes[j];
+            } else {
+                set->prefixes[i] = set->arena + arena_at;
+                set->arena[arena_at] = '{';
+                memcpy(set->arena + arena_at + 1, set->methods[i],
+                    method_length);
+                set->arena[arena_at + 1 + method_length] = '(';
+                set->arena[arena_at + 2 + method_length] = 0;
+                arena_at += method_length + 3;
+            }
+            set->suffixes[i] = ");}";
+        }
+        set->nr_tags += 1;
+    }
+    set->comments = calloc(nr_comments == 0 ? 1 : (size_t)nr_comments,
+        sizeof (char*));
+    if (set->comments == NULL) {
+        jsdev_free(set);
+        return NULL;
+    }
+    for (i = 0; i < nr_comments; i += 1) {
+        set->comments[i] = strdup(comments[i]);
+        if (set->comments[i] == NULL) {
+            jsdev_free(set);
+            return NULL;
+        }
+        set->nr_comments += 1;
+    }
+    index_tags(set);
+    if (set->trie_child == NULL || set->trie_tag == NULL) {
+        jsdev_free(set);
+        return NULL;
+    }
+/*
+    Fingerprint the whole configuration with Fowler/Noll/Vo, separating
+    the fields so that shuffled declarations hash differently.
+*/
+    set->fingerprint = 14695981039346656037ull;
+    for (i = 0; i < set->nr_tags; i += 1) {
+        set->fingerprint = fnv(set->fingerprint,
+            (unsigned char*)set->tags[i], strlen(set->tags[i]) + 1);
+        set->fingerprint = fnv(set->fingerprint,
+            (unsigned char*)set->methods[i], strlen(set->methods[i]) + 1);
+    }
+    for (i = 0; i < set->nr_comments; i += 1) {
+        set->fingerprint = fnv(set->fingerprint,
+            (unsigned char*)set->comments[i], strlen(set->comments[i]) + 1);
+    }
+    return set;
+}
+
+
+extern void
+jsdev_free(jsdev* set)
+{
+    int i;
+    if (set == NULL) {
+        return;
+    }
+    for (i = 0; i < set->nr_comments; i += 1) {
+        free(set->comments[i]);
+    }
+    free(set->comments);
+    free(set->tags);
+    free(set->methods);
+    free(set->prefixes);
+    free(set->suffixes);
+    free(set->arena);
+    free(set->trie_child);
+    free(set->trie_tag);
+    free(set);
+}
+
+
+static context*
+make_context(int nr_sets, jsdev** sets)
+{
+    int k;
+    context* ctx = calloc(1, sizeof (context));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    ctx->set = sets[0];
+    ctx->nr_channels = nr_sets;
+    ctx->only_channel = EOF;
+    pthread_mutex_init(&ctx->read_lock, NULL);
+    pthread_cond_init(&ctx->read_filled, NULL);
+    pthread_cond_init(&ctx->read_drained, NULL);
+    pthread_mutex_init(&ctx->write_lock, NULL);
+    pthread_cond_init(&ctx->write_posted, NULL);
+    pthread_cond_init(&ctx->write_taken, NULL);
+    ctx->channels = calloc((size_t)nr_sets, sizeof (channel));
+    ctx->stream_buffer = malloc(READ_BUFFER_SIZE);
+    if (ctx->channels == NULL || ctx->stream_buffer == NULL) {
+        jsdev_context_free(ctx);
+        return NULL;
+    }
+    for (k = 0; k < nr_sets; k += 1) {
+        ctx->channels[k].set = sets[k];
+        ctx->channels[k].write_buffer = malloc(WRITE_BUFFER_SIZE);
+        ctx->channels[k].heap_buffer = ctx->channels[k].write_buffer;
+        ctx->channels[k].write_limit = WRITE_BUFFER_SIZE;
+        if (ctx->channels[k].write_buffer == NULL) {
+            jsdev_context_free(ctx);
+            return NULL;
+        }
+    }
+    return ctx;
+}
+
+
+extern jsdev_context*
+jsdev_context_make(jsdev* set)
+{
+    return make_context(1, &set);
+}
+
+
+extern jsdev_context*
+jsdev_fanout_make(int nr_sets, jsdev** sets)
+{
+/*
+    Make a context that scans once and writes one output per tag set. The
+    scanner walks a merged set holding every tag that any of the sets
+    declares, and each channel keeps a map from merged tag numbers back to
+    its own, so the expansion decision is the only per channel work.
+*/
+    int k, local, max_union, t, u, nr_union = 0;
+    char** names;
+    char** swap;
+    context* ctx;
+    jsdev* merged;
+
+    if (nr_sets < 1) {
+        return NULL;
+    }
+    max_union = 8;
+    names = malloc((size_t)max_union * sizeof (char*));
+    if (names == NULL) {
+        return NULL;
+    }
+    for (k = 0; k < nr_sets; k += 1) {
+        for (t = 0; t < sets[k]->nr_tags; t += 1) {
+            for (u = 0; u < nr_union; u += 1) {
+                if (strcmp(names[u], sets[k]->tags[t]) == 0) {
+                    break;
+                }
+            }
+            if (u == nr_union) {
+                if (nr_union >= max_union) {
+                    max_union *= 2;
+                    swap = realloc(names,
+                        (size_t)max_union * sizeof (char*));
+                    if (swap == NULL) {
+                        free(names);
+                        return NULL;
+                    }
+                    names = swap;
+                }
+                names[nr_union] = sets[k]->tags[t];
+                nr_union += 1;
+            }
+        }
+    }
+    merged = jsdev_make(nr_union, names, 0, NULL, NULL);
+    free(names);
+    if (merged == NULL) {
+        return NULL;
+    }
+    ctx = make_context(nr_sets, sets);
+    if (ctx == NULL) {
+        jsdev_free(merged);
+        return NULL;
+    }
+    ctx->set = merged;
+    ctx->merged = merged;
+    ctx->tag_word = malloc((size_t)merged->longest_tag + 2);
+    if (ctx->tag_word == NULL) {
+        jsdev_context_free(ctx);
+        return NULL;
+    }
+    for (k = 0; k < nr_sets; k += 1) {
+        ctx->channels[k].tag_of = calloc(nr_union == 0 ? 1 : (size_t)nr_union,
+            sizeof (int));
+        if (ctx->channels[k].tag_of == NULL) {
+            jsdev_context_free(ctx);
+            return NULL;
+        }
+        for (u = 0; u < nr_union; u += 1) {
+            for (local = 0; local < sets[k]->nr_tags; local += 1) {
+                if (strcmp(merged->tags[u], sets[k]->tags[local]) == 0) {
+                    ctx->channels[k].tag_of[u] = local + 1;
+                    break;
+                }
+            }
+        }
+    }
+    return ctx;
+}
+
+
+extern void
+jsdev_context_free(jsdev_context* ctx)
+{
+    int k;
+    if (ctx == NULL) {
+        return;
+    }
+    stop_reader(ctx);
+    if (ctx->writer_on) {
+        pthread_mutex_lock(&ctx->write_lock);
+        ctx->write_quit = TRUE;
+        pthread_cond_signal(&ctx->write_posted);
+        pthread_mutex_unlock(&ctx->write_lock);
+        pthread_join(ctx->writer, NULL);
+    }
+    pthread_mutex_destroy(&ctx->read_lock);
+    pthread_cond_destroy(&ctx->read_filled);
+    pthread_cond_destroy(&ctx->read_drained);
+    pthread_mutex_destroy(&ctx->write_lock);
+    pthread_cond_destroy(&ctx->write_posted);
+    pthread_cond_destroy(&ctx->write_taken);
+    free(ctx->prefetch);
+    free(ctx->spare);
+    if (ctx->channels != NULL) {
+        for (k = 0; k < ctx->nr_channels; k += 1) {
+            free(ctx->channels[k].heap_buffer);
+            free(ctx->channels[k].tag_of);
+            if (ctx->channels[k].zip != NULL) {
+                deflateEnd(ctx->channels[k].zip);
+                free(ctx->channels[k].zip);
+            }
+            free(ctx->channels[k].zip_buffer);
+        }
+        free(ctx->channels);
+    }
+    jsdev_free(ctx->merged);
+    free(ctx->capture);
+    free(ctx->tag_word);
+    free(ctx->stream_buffer);
+    free(ctx);
+}
+
+
+static int
+run_file(context* ctx, char* in_path)
+{
+/*
+    Transform one file into the channels begin() prepared. A regular file
+    is memory mapped read only, so the whole program is scanned in place
+    and the kernel does the read ahead. Anything that cannot be mapped
+    goes through the buffered stream path.
 */
-                        emits("/*");
-                        emits(tag);
-                        for (;;) {
-                            if (c == EOF) {
-                                error("unterminated comment.");
-                            }
-                            if (c == '/') {
-                                c = get(TRUE);
-                                if (c == '*' || c == '/') {
-                                    error("nested comment.");
-                                }
-                            } else if (c == '*') {
-                                c = get(TRUE);
-                                if (c == '/') {
-                                    break;
-                                }
-                            } else {
-                                c = get(TRUE);
-                            }
-                        }
-                        c = get(FALSE);
-                    }
-                } else {
-                    emit('/');
+    int file;
+    struct stat status;
+    void* map;
+    jmp_buf recover;
+
+    ctx->recover = &recover;
+    if (setjmp(recover) != 0) {
+        release(ctx);
+        return EOF;
+    }
+    ctx->path = in_path;
+    file = open(in_path, O_RDONLY);
+    if (file < 0 || fstat(file, &status) != 0) {
+        if (file >= 0) {
+            close(file);
+        }
+        error(ctx, "cannot open input file.");
+    }
+    if (S_ISREG(status.st_mode) && status.st_size > 0) {
+        map = mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_PRIVATE,
+            file, 0);
+        if (map != MAP_FAILED) {
+            close(file);
+            if (ctx->async) {
+                madvise(map, (size_t)status.st_size, MADV_SEQUENTIAL);
+            }
+            ctx->map = (unsigned char*)map;
+            ctx->map_length = (size_t)status.st_size;
+            ctx->read_buffer = ctx->map;
+            ctx->read_limit = ctx->map_length;
+            ctx->read_mapped = TRUE;
+        }
+    }
+    if (!ctx->read_mapped) {
+        close(file);
+        ctx->in = fopen(in_path, "rb");
+        if (ctx->in == NULL) {
+            error(ctx, "cannot open input file.");
+        }
+    }
+    map_outputs(ctx);
 /*
-    We are looking at a single slash. Is it a division operator, or is it the
-    start of a regexp literal? If is not possible to tell for sure without doing
-    a complete parse of the program, and we are not going to do that. Instead,
-    we are adopting the convention that a regexp literal must have one of a
-    small set of characters to its left.
+    A mapped file that cannot expand anything is copied through in one
+    piece instead of being scanned byte by byte.
 */
-                    if (pre_regexp(left)) {
-                        regexp(FALSE);
-                    }
-                    left = '/';
-                    c = get(FALSE);
+    if (ctx->read_mapped && ctx->strip == 0
+            && !expandable(ctx->set, ctx->map, ctx->map_length)) {
+        preface(ctx);
+        emit_span(ctx, ctx->map, ctx->map_length);
+        if (ctx->stats != NULL) {
+            ctx->stats->bytes += ctx->map_length;
+        }
+        flush(ctx);
+        settle_index(ctx, ctx->map_length);
+        finish(ctx);
+        release(ctx);
+        return 0;
+    }
+    transform(ctx);
+    flush(ctx);
+    settle_index(ctx, ctx->base + ctx->read_at);
+    finish(ctx);
+    release(ctx);
+    return 0;
+}
+
+
+extern int
+jsdev_file(jsdev_context* ctx, char* in_path, FILE* out)
+{
+    begin(ctx, out);
+    return run_file(ctx, in_path);
+}
+
+
+extern int
+jsdev_fanout_file(jsdev_context* ctx, char* in_path, FILE** outs)
+{
+/*
+    Transform one file in a single pass, writing the result for each of
+    the fan out context's tag sets to the matching stream in outs.
+*/
+    int k;
+    begin(ctx, outs[0]);
+    for (k = 1; k < ctx->nr_channels; k += 1) {
+        ctx->channels[k].out = outs[k];
+    }
+    return run_file(ctx, in_path);
+}
+
+
+extern int
+jsdev_stream(jsdev_context* ctx, FILE* in, FILE* out)
+{
+/*
+    Transform an open stream into out. Both streams belong to the caller.
+*/
+    jmp_buf recover;
+
+    ctx->recover = &recover;
+    if (setjmp(recover) != 0) {
+        stop_reader(ctx);
+        ctx->in = NULL;
+        release(ctx);
+        return EOF;
+    }
+    begin(ctx, out);
+    ctx->in = in;
+    transform(ctx);
+    flush(ctx);
+    settle_index(ctx, ctx->base + ctx->read_at);
+    finish(ctx);
+    ctx->in = NULL;
+    ctx->channels[0].out = NULL;
+    return 0;
+}
+
+
+static int
+scan_span(jsdev_context* ctx, unsigned char* source, size_t length,
+    int lead, char** result, size_t* result_length)
+{
+/*
+    Scan a span of memory into a malloc'd result. The comment lines are
+    written only when lead is set, so a span that continues a larger
+    input can be scanned without them.
+*/
+    jmp_buf recover;
+    FILE* volatile out;
+
+    *result = NULL;
+    *result_length = 0;
+    out = open_memstream(result, result_length);
+    if (out == NULL) {
+        ctx->line_nr = 0;
+        ctx->error_message = "out of memory.";
+        return EOF;
+    }
+    ctx->recover = &recover;
+    if (setjmp(recover) != 0) {
+        release(ctx);
+        fclose(out);
+        free(*result);
+        *result = NULL;
+        *result_length = 0;
+        return EOF;
+    }
+    begin(ctx, out);
+    ctx->read_buffer = source;
+    ctx->read_limit = length;
+    ctx->read_mapped = TRUE;
+    if (lead) {
+        preface(ctx);
+    }
+    process(ctx);
+    flush(ctx);
+    settle_index(ctx, length);
+    finish(ctx);
+    ctx->channels[0].out = NULL;
+    if (fclose(out) != 0) {
+        ctx->error_message = "out of memory.";
+        return EOF;
+    }
+    return 0;
+}
+
+
+extern int
+jsdev_transform(jsdev_context* ctx, char* source, size_t length,
+    char** result, size_t* result_length)
+{
+/*
+    Transform memory to memory. The malloc'd result belongs to the caller
+    on success. The source is scanned in place.
+*/
+    return scan_span(ctx, (unsigned char*)source, length, TRUE,
+        result, result_length);
+}
+
+
+/*
+    One shard of a parallel scan: a slice of the mapped input, the
+    malloc'd slice of the output, and a private stats block folded into
+    the caller's afterward.
+*/
+
+struct shard {
+    jsdev* set;
+    unsigned char* data;
+    size_t length;
+    int    lead;          /* does this shard write the comment lines? */
+    int    strip;
+    int    wants_stats;
+    char*  result;
+    size_t result_length;
+    int    ok;
+    jsdev_stats stats;
+};
+
+
+static void*
+shard_worker(void* arg)
+{
+    struct shard* job = arg;
+    jsdev_context* ctx = jsdev_context_make(job->set);
+    if (ctx == NULL) {
+        job->ok = FALSE;
+        return NULL;
+    }
+    if (job->wants_stats) {
+        jsdev_collect(ctx, &job->stats);
+    }
+    jsdev_strip(ctx, job->strip);
+    job->ok = scan_span(ctx, job->data, job->length, job->lead,
+        &job->result, &job->result_length) == 0;
+    jsdev_context_free(ctx);
+    return NULL;
+}
+
+
+static size_t
+shard_boundary(unsigned char* data, size_t length, size_t near)
+{
+/*
+    Pick a split close to near at which a shard can start scanning as
+    plain program text: just after a line break, moved past any block
+    comment the raw text suggests is open there, and past any line whose
+    first character is a slash, because a slash's meaning depends on
+    what came before the split. The choice only has to be plausible, not
+    certain: a split that still lands inside a literal makes the shard
+    in front of it fail its scan, and the caller falls back to the
+    serial scan, which is always right.
+*/
+    size_t at = near, back, look;
+
+    at += find_byte(data + at, length - at, '\n', '\r', '\n', '\r');
+    if (at >= length || data[at] == 0) {
+        return length;
+    }
+    at += 1;
+    for (;;) {
+        if (at >= length) {
+            return length;
+        }
+/*
+    Look backward, a bounded distance, for the nearest comment marker.
+    An opener means the split is probably inside a block comment, so
+    move it past the close.
+*/
+        back = at > (size_t)READ_BUFFER_SIZE / 16
+            ? at - (size_t)READ_BUFFER_SIZE / 16 : 0;
+        for (look = at; look >= back + 2; look -= 1) {
+            if (data[look - 2] == '*' && data[look - 1] == '/') {
+                break;
+            }
+            if (data[look - 2] == '/' && data[look - 1] == '*') {
+                while (at + 1 < length
+                        && !(data[at] == '*' && data[at + 1] == '/')) {
+                    at += 1;
                 }
+                at += 2;
+                if (at > length) {
+                    return length;
+                }
+                at += find_byte(data + at, length - at,
+                    '\n', '\r', '\n', '\r');
+                if (at >= length || data[at] == 0) {
+                    return length;
+                }
+                at += 1;
+                look = 0;
+                break;
             }
-        } else {
+        }
+        if (look != 0) {
 /*
-    The character was nothing special, to just echo it.
-    If it wasn't whitespace, remember it as the character to the left of the
-    next character.
+    A shard whose first significant character is a slash could be read
+    as a regexp or as division depending on the other side of the
+    split, so push the split past that line.
 */
-            emit(c);
-            if (c > ' ') {
-                left = c;
+            look = at;
+            while (look < length && (data[look] == ' ' || data[look] == '\t'
+                    || data[look] == '\n' || data[look] == '\r')) {
+                look += 1;
             }
-            c = get(FALSE);
+            if (look >= length || data[look] != '/') {
+                return at;
+            }
+            at = look
+                + find_byte(data + look, length - look, '\n', '\r', '\n', '\r');
+            if (at >= length || data[at] == 0) {
+                return length;
+            }
+            at += 1;
         }
     }
 }
 
 
 extern int
-main(int argc, char* argv[])
-{
-    int c = EOF, comment = FALSE, i, j, k;
-    cr = FALSE;
-    line_nr = 0;
-    nr_tags = 0;
-    for (i = 1; i < argc; i += 1) {
-        if (comment) {
-            comment = FALSE;
-            emits("// ");
-            emits(argv[i]);
-            emit('\n');
-        } else if (strcmp(argv[i], "-comment") == 0) {
-            comment = TRUE;
-        } else {
-            for (j = 0; j < MAX_TAG_LENGTH; j += 1) {
-                c = argv[i][j];
-                if (!is_alphanum(c)) {
-                    break;
-                }
-                tags[nr_tags][j] = (char)c;
-            }
-            if (j == 0) {
-                error(argv[i]);
-            }
-            tags[nr_tags][j] = 0;
-            if (c == 0) {
-                methods[nr_tags][0] = 0;
-            } else if (c == ':') {
-                j += 1;
-                for (k = 0; k < MAX_TAG_LENGTH; k += 1) {
-                    c = argv[i][j + k];
-                    if (!is_alphanum(c)) {
-                        break;
+jsdev_parallel_file(jsdev_context* ctx, char* in_path, FILE* out,
+    int nr_workers)
+{
+/*
+    Transform one large mapped file with several threads. The input is
+    split at plausible statement boundaries and each shard is scanned
+    speculatively as if it began in plain program text; the output
+    slices are then stitched in order. A shard that was split inside a
+    literal fails its scan, and anything surprising - a scan failure, an
+    unmappable input, a NUL, a file too small to share - falls back to
+    the ordinary serial scan, whose result and diagnostics are the
+    contract.
+*/
+    int file, k, nr_shards = 0, ok = TRUE, t;
+    size_t at, length, limit, near;
+    struct stat status;
+    void* map;
+    struct shard* shards;
+    pthread_t* threads;
+
+    if (nr_workers < 2 || ctx->nr_channels != 1 || ctx->index != NULL
+            || ctx->channels->zip != NULL) {
+        return jsdev_file(ctx, in_path, out);
+    }
+    file = open(in_path, O_RDONLY);
+    if (file < 0 || fstat(file, &status) != 0 || !S_ISREG(status.st_mode)
+            || (size_t)status.st_size < 2 * (size_t)SHARD_MIN) {
+        if (file >= 0) {
+            close(file);
+        }
+        return jsdev_file(ctx, in_path, out);
+    }
+    length = (size_t)status.st_size;
+    map = mmap(NULL, length, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if (map == MAP_FAILED) {
+        return jsdev_file(ctx, in_path, out);
+    }
+    if (find_byte(map, length, 0, 0, 0, 0) < length) {
+        munmap(map, length);
+        return jsdev_file(ctx, in_path, out);
+    }
+    k = nr_workers;
+    while (k > 1 && length / (size_t)k < (size_t)SHARD_MIN) {
+        k -= 1;
+    }
+    shards = calloc((size_t)k, sizeof (struct shard));
+    threads = malloc((size_t)k * sizeof (pthread_t));
+    if (shards == NULL || threads == NULL) {
+        free(shards);
+        free(threads);
+        munmap(map, length);
+        return jsdev_file(ctx, in_path, out);
+    }
+    at = 0;
+    while (nr_shards < k && at < length) {
+        near = length / (size_t)k * (size_t)(nr_shards + 1);
+        limit = nr_shards == k - 1 || near <= at ? length
+            : shard_boundary(map, length, near);
+        shards[nr_shards].set = ctx->set;
+        shards[nr_shards].data = (unsigned char*)map + at;
+        shards[nr_shards].length = limit - at;
+        shards[nr_shards].lead = nr_shards == 0;
+        shards[nr_shards].strip = ctx->strip;
+        shards[nr_shards].wants_stats = ctx->stats != NULL;
+        if (ctx->stats != NULL && ctx->stats->tag_matches != NULL) {
+            shards[nr_shards].stats.tag_matches =
+                calloc((size_t)ctx->set->nr_tags + 1,
+                    sizeof (unsigned long long));
+        }
+        nr_shards += 1;
+        at = limit;
+    }
+    if (nr_shards < 2) {
+        free(shards);
+        free(threads);
+        munmap(map, length);
+        return jsdev_file(ctx, in_path, out);
+    }
+    for (k = 0; k < nr_shards; k += 1) {
+        if (pthread_create(threads + k, NULL, shard_worker, shards + k)
+                != 0) {
+            shard_worker(shards + k);
+            threads[k] = pthread_self();
+        }
+    }
+    for (k = 0; k < nr_shards; k += 1) {
+        if (!pthread_equal(threads[k], pthread_self())) {
+            pthread_join(threads[k], NULL);
+        }
+        ok = ok && shards[k].ok;
+    }
+    if (ok) {
+        for (k = 0; k < nr_shards; k += 1) {
+            if (fwrite(shards[k].result, 1, shards[k].result_length, out)
+                    != shards[k].result_length) {
+                ctx->line_nr = 0;
+                ctx->error_message = "cannot write output file.";
+                ok = EOF;
+                break;
+            }
+            if (ctx->stats != NULL) {
+                ctx->stats->bytes += shards[k].stats.bytes;
+                ctx->stats->lines += shards[k].stats.lines;
+                ctx->stats->comments += shards[k].stats.comments;
+                ctx->stats->matches += shards[k].stats.matches;
+                ctx->stats->literal_bytes += shards[k].stats.literal_bytes;
+                ctx->stats->process_seconds += shards[k].stats.process_seconds;
+                ctx->stats->string_seconds += shards[k].stats.string_seconds;
+                ctx->stats->regexp_seconds += shards[k].stats.regexp_seconds;
+                ctx->stats->expand_seconds += shards[k].stats.expand_seconds;
+                if (ctx->stats->tag_matches != NULL
+                        && shards[k].stats.tag_matches != NULL) {
+                    for (t = 0; t < ctx->set->nr_tags; t += 1) {
+                        ctx->stats->tag_matches[t] +=
+                            shards[k].stats.tag_matches[t];
                     }
-                    methods[nr_tags][k] = (char)c;
                 }
-                methods[nr_tags][k] = 0;
-                if (k == 0 || c != 0) {
-                    error(argv[i]);
-                }
-            } else {
-                error(argv[i]);
             }
-            nr_tags += 1;
         }
     }
-    process();
+    for (k = 0; k < nr_shards; k += 1) {
+        free(shards[k].result);
+        free(shards[k].stats.tag_matches);
+    }
+    free(shards);
+    free(threads);
+    munmap(map, length);
+    if (ok == EOF) {
+        return EOF;
+    }
+    if (!ok) {
+        return jsdev_file(ctx, in_path, out);
+    }
+    return 0;
+}
+
+
+extern char*
+jsdev_message(jsdev_context* ctx)
+{
+    return ctx->error_message;
+}
+
+
+extern int
+jsdev_line(jsdev_context* ctx)
+{
+    return ctx->line_nr;
+}
+
+
+extern void
+jsdev_collect(jsdev_context* ctx, jsdev_stats* stats)
+{
+    ctx->stats = stats;
+}
+
+
+extern void
+jsdev_index(jsdev_context* ctx, FILE* index)
+{
+    ctx->index = index;
+    ctx->indexed = FALSE;
+}
+
+
+extern int
+jsdev_pipeline(jsdev_context* ctx, int on)
+{
+/*
+    Turn the pipelined mode on or off, allocating its buffers the first
+    time. Returns 0, or EOF when memory is exhausted, in which case the
+    context keeps working synchronously.
+*/
+    if (on && ctx->prefetch == NULL) {
+        ctx->prefetch = malloc(READ_BUFFER_SIZE);
+        ctx->spare = malloc(WRITE_BUFFER_SIZE);
+        if (ctx->prefetch == NULL || ctx->spare == NULL) {
+            free(ctx->prefetch);
+            free(ctx->spare);
+            ctx->prefetch = NULL;
+            ctx->spare = NULL;
+            ctx->async = FALSE;
+            return EOF;
+        }
+    }
+    ctx->async = on != 0;
+    return 0;
+}
+
+
+extern void
+jsdev_outmap(jsdev_context* ctx, int on)
+{
+/*
+    Turn the mapped output mode on or off. With it on, a mapped input
+    whose output is a regular file is written through a preallocated
+    mapping of the destination instead of buffered writes; everything
+    else keeps the buffered path.
+*/
+    ctx->outmap = on != 0;
+}
+
+
+extern void
+jsdev_strip(jsdev_context* ctx, int level)
+{
+/*
+    Set the context's strip level: at 1 a comment with a pattern's shape
+    that did not expand is dropped instead of echoed, and at 2 every
+    comment is dropped. The line break that ends a stripped line comment
+    is kept.
+*/
+    ctx->strip = level < 0 ? 0 : level > 2 ? 2 : level;
+}
+
+
+extern int
+jsdev_gzip(jsdev_context* ctx, int on)
+{
+/*
+    Turn the context's compressed output stage on or off. With it on,
+    each channel's bytes pass through a streaming gzip encoder on their
+    way to the out stream, so the compressed artifact is written
+    directly, with no second process and no pipe copy; in pipelined
+    mode the encoding runs on the writer thread, behind the scan.
+    Returns 0, or EOF when an encoder cannot be made, in which case the
+    output stays plain.
+*/
+    int k;
+    channel* chn;
+    for (k = 0; k < ctx->nr_channels; k += 1) {
+        chn = ctx->channels + k;
+        if (on && chn->zip == NULL) {
+            chn->zip = calloc(1, sizeof (z_stream));
+            chn->zip_buffer = malloc(WRITE_BUFFER_SIZE);
+            if (chn->zip == NULL || chn->zip_buffer == NULL
+                    || deflateInit2(chn->zip, Z_DEFAULT_COMPRESSION,
+                        Z_DEFLATED, 15 + 16, 8,
+                        Z_DEFAULT_STRATEGY) != Z_OK) {
+                free(chn->zip);
+                free(chn->zip_buffer);
+                chn->zip = NULL;
+                chn->zip_buffer = NULL;
+                jsdev_gzip(ctx, FALSE);
+                return EOF;
+            }
+        } else if (!on && chn->zip != NULL) {
+            deflateEnd(chn->zip);
+            free(chn->zip);
+            free(chn->zip_buffer);
+            chn->zip = NULL;
+            chn->zip_buffer = NULL;
+        }
+    }
     return 0;
 }
+
+
+extern int
+jsdev_nr_tags(jsdev* set)
+{
+    return set->nr_tags;
+}
+
+
+extern char*
+jsdev_tag(jsdev* set, int tag_nr)
+{
+    return tag_nr < 0 || tag_nr >= set->nr_tags ? NULL : set->tags[tag_nr];
+}
+
+
+extern unsigned long long
+jsdev_fingerprint(jsdev* set)
+{
+    return set->fingerprint;
+}
+
+
+extern unsigned long long
+jsdev_hash(unsigned long long hash, void* data, size_t length)
+{
+    return fnv(hash, (unsigned char*)data, length);
+}
+
+
+static void
+generate_string(FILE* out, char* text)
+{
+/*
+    Write a C string literal for the generated source.
+*/
+    int c;
+    fputc('"', out);
+    for (; *text; text += 1) {
+        c = (unsigned char)*text;
+        if (c == '"' || c == '\\') {
+            fputc('\\', out);
+            fputc(c, out);
+        } else if (c == '\n') {
+            fputs("\\n", out);
+        } else if (c == '\r') {
+            fputs("\\r", out);
+        } else if (c < ' ' || c > '~') {
+            fprintf(out, "\\%03o", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+
+static void
+generate_strings(FILE* out, char* name, char** strings, int nr)
+{
+    int i;
+    fprintf(out, "static char* builtin_%s[] = {", name);
+    if (nr == 0) {
+        fputs("0", out);
+    }
+    for (i = 0; i < nr; i += 1) {
+        fputs(i == 0 ? "\n    " : ",\n    ", out);
+        generate_string(out, strings[i]);
+    }
+    fputs("\n};\n\n", out);
+}
+
+
+extern int
+jsdev_generate(jsdev* set, FILE* out)
+{
+/*
+    Write a C source for a filter specialized to the tag set: the
+    compiled trie, the interned names, the expansion templates, and the
+    comment lines become constants, and the generated main reads stdin
+    and writes stdout the way the classic filter does. The source
+    includes jsdev.c, so it is built next to a copy of this library:
+
+        cc -O2 -o filter generated.c -lpthread -lz
+
+    Returns 0, or EOF when the stream reports a write error.
+*/
+    int i, node, symbol;
+
+    fputs("/*  Generated by jsdev -compile. Do not edit: rerun -compile\n"
+          "    with the tag configuration instead. Build this file next\n"
+          "    to jsdev.c and jsdev.h:\n"
+          "\n"
+          "        cc -O2 -o filter <thisfile>.c -lpthread -lz\n"
+          "*/\n"
+          "\n"
+          "#include \"jsdev.c\"\n"
+          "\n", out);
+    fprintf(out, "static int builtin_trie_child[%d][TRIE_WIDTH] = {\n",
+        set->nr_nodes);
+    for (node = 0; node < set->nr_nodes; node += 1) {
+        fputs("    {", out);
+        for (symbol = 0; symbol < TRIE_WIDTH; symbol += 1) {
+            fprintf(out, symbol == 0 ? "%d" : ",%d",
+                set->trie_child[node][symbol]);
+        }
+        fputs(node + 1 < set->nr_nodes ? "},\n" : "}\n", out);
+    }
+    fputs("};\n\n", out);
+    fprintf(out, "static int builtin_trie_tag[%d] = {", set->nr_nodes);
+    for (node = 0; node < set->nr_nodes; node += 1) {
+        fprintf(out, node == 0 ? "%d" : ",%d", set->trie_tag[node]);
+    }
+    fputs("};\n\n", out);
+    generate_strings(out, "tags", set->tags, set->nr_tags);
+    generate_strings(out, "methods", set->methods, set->nr_tags);
+    generate_strings(out, "prefixes", set->prefixes, set->nr_tags);
+    generate_strings(out, "suffixes", set->suffixes, set->nr_tags);
+    generate_strings(out, "comments", set->comments, set->nr_comments);
+    fputs("static jsdev builtin_set = {\n", out);
+    fprintf(out, "    .fingerprint = %lluull,\n", set->fingerprint);
+    fprintf(out, "    .nr_comments = %d,\n", set->nr_comments);
+    fprintf(out, "    .nr_nodes = %d,\n", set->nr_nodes);
+    fprintf(out, "    .nr_tags = %d,\n", set->nr_tags);
+    fprintf(out, "    .longest_tag = %d,\n", set->longest_tag);
+    fputs("    .comments = builtin_comments,\n"
+          "    .tags = builtin_tags,\n"
+          "    .methods = builtin_methods,\n"
+          "    .prefixes = builtin_prefixes,\n"
+          "    .suffixes = builtin_suffixes,\n"
+          "    .trie_child = builtin_trie_child,\n"
+          "    .trie_tag = builtin_trie_tag,\n"
+          "    .symbol_of = {", out);
+    for (i = 0; i < 256; i += 1) {
+        fprintf(out, i == 0 ? "%d" : ",%d", set->symbol_of[i]);
+    }
+    fputs("}\n};\n\n\n", out);
+    fputs("extern int\n"
+          "main(void)\n"
+          "{\n"
+          "    jsdev_context* ctx = jsdev_context_make(&builtin_set);\n"
+          "    if (ctx == NULL) {\n"
+          "        fputs(\"JSDev: out of memory.\\r\\n\", stderr);\n"
+          "        return 1;\n"
+          "    }\n"
+          "    if (jsdev_stream(ctx, stdin, stdout) != 0) {\n"
+          "        fputs(\"JSDev: \", stderr);\n"
+          "        if (jsdev_line(ctx)) {\n"
+          "            fprintf(stderr, \"%d. \", jsdev_line(ctx));\n"
+          "        }\n"
+          "        fputs(jsdev_message(ctx), stderr);\n"
+          "        fputs(\"\\r\\n\", stderr);\n"
+          "        return 1;\n"
+          "    }\n"
+          "    return 0;\n"
+          "}\n", out);
+    return ferror(out) ? EOF : 0;
+}
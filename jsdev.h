@@ -0,0 +1,204 @@
+/*  jsdev.h
+    Public Domain
+
+    The public interface of the JSDev library. See jsdev.c for what the
+    preprocessor does.
+
+    A jsdev is a compiled tag set. It is built once from method line names
+    ("tag" or "tag:method") and optional comment strings, and is read only
+    after that, so one set can be shared by any number of threads.
+
+    A jsdev_context carries one scanner's working state and buffers. Make
+    one per thread and reuse it across calls. The processing functions
+    return 0 on success and EOF on failure; after a failure,
+    jsdev_message() and jsdev_line() describe what went wrong. Nothing in
+    the library writes to stderr or exits.
+*/
+
+#ifndef JSDEV_H
+#define JSDEV_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+typedef struct jsdev jsdev;
+typedef struct jsdev_context jsdev_context;
+
+/*
+    jsdev_make returns NULL if a name is bad or memory is exhausted. When a
+    name is bad, its index is stored through bad_name, which may be NULL;
+    memory exhaustion stores EOF.
+*/
+
+extern jsdev* jsdev_make(int nr_names, char** names,
+    int nr_comments, char** comments, int* bad_name);
+extern void jsdev_free(jsdev* set);
+
+extern jsdev_context* jsdev_context_make(jsdev* set);
+extern void jsdev_context_free(jsdev_context* ctx);
+
+/*
+    A fan out context scans a source once and writes one output per tag
+    set, sharing the tokenization across all of them. jsdev_fanout_make
+    returns NULL when there are no sets or when memory is exhausted. Use
+    the context with jsdev_fanout_file, passing one open stream per set,
+    in the same order.
+*/
+
+extern jsdev_context* jsdev_fanout_make(int nr_sets, jsdev** sets);
+extern int jsdev_fanout_file(jsdev_context* ctx, char* in_path, FILE** outs);
+
+/*
+    jsdev_file reads a file, memory mapping it when possible. jsdev_stream
+    reads an open stream. Both write the result to out, which the caller
+    owns. jsdev_transform works memory to memory: the result is malloc'd
+    and handed to the caller.
+
+    A mapped file that contains no comment opener that could begin a
+    declared tag is copied through in one piece. Such a file cannot be
+    changed by the transformation, so it is not scanned, and ill formed
+    program text in it is not diagnosed.
+*/
+
+extern int jsdev_file(jsdev_context* ctx, char* in_path, FILE* out);
+extern int jsdev_stream(jsdev_context* ctx, FILE* in, FILE* out);
+extern int jsdev_transform(jsdev_context* ctx, char* source, size_t length,
+    char** result, size_t* result_length);
+
+/*
+    jsdev_parallel_file transforms one large file with several threads,
+    splitting the mapped input at plausible statement boundaries,
+    scanning the shards speculatively, and stitching the output slices
+    in order. A shard split inside a literal fails its scan, and any
+    surprise falls back to the serial scan, so the result and the
+    diagnostics are always those of jsdev_file. Small files, unmappable
+    inputs, and fan out contexts take the serial path directly.
+*/
+
+extern int jsdev_parallel_file(jsdev_context* ctx, char* in_path, FILE* out,
+    int nr_workers);
+
+extern char* jsdev_message(jsdev_context* ctx);
+extern int jsdev_line(jsdev_context* ctx);
+
+/*
+    jsdev_pipeline turns on a context's pipelined mode: a prefetch thread
+    keeps the next block of a streamed input ready while the scanner
+    works, a writer thread retires each filled output buffer while the
+    next one fills, and memory mapped inputs are advised to the kernel
+    for sequential read ahead. The output is identical; only the overlap
+    of I/O and scanning changes. Returns 0, or EOF when the pipeline
+    buffers cannot be allocated, in which case the context stays
+    synchronous.
+*/
+
+extern int jsdev_pipeline(jsdev_context* ctx, int on);
+
+/*
+    jsdev_outmap turns on a context's mapped output mode: when the input
+    is memory mapped and the output is a regular file, the destination
+    is extended to a bound the result cannot exceed, mapped, written in
+    place, and truncated to the real length at the end, so the hot path
+    makes no write calls at all. Outputs that cannot be mapped keep the
+    buffered path. The output is identical either way.
+*/
+
+extern void jsdev_outmap(jsdev_context* ctx, int on);
+
+/*
+    jsdev_strip sets a context's strip level. At level 1, a comment
+    whose first word has a pattern's shape but did not expand is dropped
+    instead of echoed; at level 2 every comment is dropped, so a
+    production build needs no separate comment stripping pass. The line
+    break that ends a stripped line comment is kept, and expanded
+    patterns are unaffected. Level 0 echoes everything again.
+*/
+
+extern void jsdev_strip(jsdev_context* ctx, int level);
+
+/*
+    jsdev_gzip turns the context's compressed output stage on or off.
+    With it on, each output's bytes pass through a streaming gzip
+    encoder in process, so the compressed artifact is written directly
+    instead of being piped through a second program; in pipelined mode
+    the encoding runs on the writer thread, behind the scan. Returns 0,
+    or EOF when an encoder cannot be made, in which case the output
+    stays plain.
+*/
+
+extern int jsdev_gzip(jsdev_context* ctx, int on);
+
+/*
+    A context can collect counters and timings into a caller owned stats
+    block, attached with jsdev_collect and detached by attaching NULL.
+    The caller zeroes the block; the scanner only ever adds to it, so one
+    block can accumulate over many files. tag_matches may be NULL, or an
+    array with one counter per tag of the scanned set, indexed like the
+    set's declarations. The string, regexp, and expand times are parts of
+    the process time, not additions to it. Collection costs a test on the
+    scanner's hot paths when it is off, and some clock reads per literal
+    and expansion when it is on.
+*/
+
+typedef struct jsdev_stats {
+    unsigned long long bytes;          /* input bytes scanned */
+    unsigned long long lines;
+    unsigned long long comments;       /* line and block comments seen */
+    unsigned long long matches;        /* patterns expanded */
+    unsigned long long literal_bytes;  /* string and regexp bytes skipped */
+    unsigned long long* tag_matches;   /* per tag expansions, or NULL */
+    double process_seconds;
+    double string_seconds;
+    double regexp_seconds;
+    double expand_seconds;
+} jsdev_stats;
+
+extern void jsdev_collect(jsdev_context* ctx, jsdev_stats* stats);
+
+/*
+    A context can write an expansion span index to an attached stream,
+    detached by attaching NULL. Each record is four unsigned 64 bit
+    numbers in the machine's byte order: the offset and length of a
+    region the expansion rewrote in the input, then the offset and
+    length of its replacement in the output, in file order. After each
+    whole input comes one summary record, told apart by its zero second
+    number: the total input length, zero, the total output length, and
+    one when the output differs from the input at all, or zero when it
+    is an untouched copy. A downstream tool can then reprocess only the
+    changed spans and splice its cached results for the rest. Fan out
+    contexts do not record, and a context with an index attached takes
+    jsdev_parallel_file's serial path, so the offsets are exact.
+*/
+
+extern void jsdev_index(jsdev_context* ctx, FILE* index);
+
+extern int jsdev_nr_tags(jsdev* set);
+extern char* jsdev_tag(jsdev* set, int tag_nr);
+
+/*
+    jsdev_generate writes a C source for a filter specialized to the tag
+    set: the compiled trie, the expansion templates, and the comment
+    lines baked in as constants, with a main that filters stdin to
+    stdout. The source includes jsdev.c, so it builds next to a copy of
+    this library. Returns 0, or EOF on a stream write error.
+*/
+
+extern int jsdev_generate(jsdev* set, FILE* out);
+
+/*
+    jsdev_fingerprint returns a hash of everything about the tag set that
+    influences the output, so a cache of results can be keyed on the
+    fingerprint plus the input content.
+*/
+
+extern unsigned long long jsdev_fingerprint(jsdev* set);
+
+/*
+    jsdev_hash folds a run of bytes into a running hash. Seed it with a
+    fingerprint to make a cache key.
+*/
+
+extern unsigned long long jsdev_hash(unsigned long long hash,
+    void* data, size_t length);
+
+#endif
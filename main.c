@@ -0,0 +1,2156 @@
+/*  main.c
+    Public Domain
+
+    The JSDev command line tool, built on the library in jsdev.c.
+
+    The command line will contain a list of <tag> names, each of which can
+    optionally be followed by a colon and <method> name. There must not be
+    any spaces around the colon. See jsdev.c for what the tags do.
+
+    Sample method line:
+
+        jsdev debug log:console.log alarm:alert -comment "Devel Edition"
+
+    The method line can also contain options. An argument of the form
+    @<filepath> names a response file whose whitespace separated tokens
+    are spliced into the method line in its place, so a build system can
+    hand over an arbitrarily long configuration in one file. Inside a
+    response file, # discards the rest of its line.
+
+        -comment <comment>
+
+            A string that will be prepended to the output as a comment.
+
+        -input <filepath>
+
+            The program is read from the file instead of stdin. Each file
+            is memory mapped when possible, so the scanner works directly
+            on the file pages without copying them. -input may be
+            repeated. In a batch, a file that fails is reported with its
+            line and the rest of the batch still runs; the exit status
+            is 1 when anything failed.
+
+        -outdir <directory>
+
+            Each input file's result is written to a file of the same name
+            in the directory. This is required when there is more than one
+            -input.
+
+        -jobs <number>
+
+            The number of worker threads that process the input files
+            concurrently. The default is the number of processors. A
+            batch is scheduled largest file first, and a file bigger
+            than a fair share of the batch is itself split across the
+            workers and scanned in parallel, as a single large input
+            always is, so the batch is never stuck waiting on one core
+            scanning one huge file; -jobs 1 keeps the scan serial.
+
+        -cache <directory>
+
+            Keep transformed results in the directory, keyed on the input
+            content and the whole tag configuration. An input that was
+            seen before is delivered from the cache - hardlinked into
+            -outdir when possible - without being scanned again.
+
+        -manifest <filepath>
+
+            Execute a batch described by the file: one entry per line,
+            an input path, an output path, and optionally the name of a
+            -profile whose tag set applies, separated by whitespace.
+            Blank lines and lines starting with # are skipped. The whole
+            batch runs in one process with one tag table build, spread
+            over the -jobs workers, and each output lands exactly where
+            its entry says, so a build system execs jsdev once instead
+            of once per file. An entry that fails is reported and the
+            batch continues. Does not combine with -input, -cache,
+            -server, or -watch; with -profile it needs no -outdir.
+
+        -compile <filepath>
+
+            Instead of processing anything, write a C source for a
+            filter specialized to the tag configuration: the compiled
+            tag tables, expansion templates, and comments baked in as
+            constants, with a main that filters stdin to stdout. Build
+            the file next to a copy of jsdev.c and jsdev.h:
+
+                cc -O2 -o filter generated.c -lpthread -lz
+
+            Only tags and -comment may accompany -compile.
+
+        -gzip
+
+            Compress each output with a streaming gzip encoder in
+            process, instead of piping the result through a second
+            program. Files written under -outdir get .gz appended to
+            their names; with -manifest and on stdout the compressed
+            bytes go exactly where the plain ones would have. With
+            -pipeline the encoding runs on the writer thread, behind
+            the scan.
+
+        -index
+
+            Write, next to each output file, a sidecar of the same name
+            with .idx appended: a binary index of the regions the
+            expansion rewrote - input offset and length, output offset
+            and length - and a flag for files the transformation left
+            untouched, so a minifier or source map stage can reprocess
+            only the changed spans. See jsdev.h for the record format.
+            Requires -outdir or -manifest, and does not combine with
+            -cache or a -profile batch.
+
+        -stats
+
+            Collect counters and phase timings while processing - bytes
+            scanned, lines, comments seen, patterns expanded per tag,
+            string and regexp bytes skipped, and the time spent in the
+            scanner's phases - and print them to stderr as one machine
+            readable line at exit. Not reported in -server mode.
+
+        -strip
+
+            Drop each comment whose first word has a pattern's shape but
+            that did not expand, instead of echoing it. A production
+            build that activates nothing then sheds its development tags
+            in the same pass, without a separate comment stripper.
+
+        -stripall
+
+            Drop every comment that is not an expanded pattern. The line
+            break that ends a stripped line comment is kept, so line
+            numbers survive.
+
+        -watch
+
+            After the input files are processed, stay resident and watch
+            them, reprocessing a file whenever it changes. The tag tables
+            stay warm, and with -cache only genuinely new content is
+            scanned. Requires -input and -outdir. A file that fails to
+            process is reported and watched further rather than aborting
+            the watch.
+
+        -outmap
+
+            Write each result through a preallocated memory mapping of
+            its output file: the destination is extended to a bound the
+            result cannot exceed, written in place, and truncated to the
+            real length at the end, so the hot path makes no write
+            calls. Applies when the input is mapped and the output is a
+            regular file; everything else keeps the buffered writes. The
+            output is identical either way.
+
+        -pipeline
+
+            Overlap reading, scanning, and writing: a prefetch thread
+            keeps the next block of a streamed input ready while the
+            scanner works, and a writer thread retires each filled
+            output buffer while the next one fills. Hides disk latency
+            behind computation on slow filesystems. The output is
+            identical either way.
+
+        -profile <name>
+
+            Begin a named tag set profile. The tags that follow, up to the
+            next -profile, belong to it; tags named before the first
+            -profile are shared by every profile. Each input file is
+            scanned once and an output is written for every profile under
+            <outdir>/<name>, so building four flavors costs one pass
+            instead of four. Requires -input and -outdir, and does not
+            combine with -cache, -server, or -watch.
+
+        -server <socketpath>
+
+            Instead of processing files and exiting, stay resident and
+            accept jobs over a unix domain socket, the way compiler
+            daemons do. When the argument is a number, the daemon
+            listens on that TCP port instead, so other machines can
+            send it work. The tag tables are built once. Each
+            connection carries one job, a line in one of these forms:
+
+                file <inputpath> <outputpath>
+                source <length>
+                set <fingerprint>
+                keyed <key> <length>
+                fetch <key>
+                quit
+
+            A file job processes one file and answers "ok" or
+            "error <linenumber> <message>". A source job is followed by
+            <length> bytes of program text, and the answer is
+            "ok <length>" followed by the result, or an error line. A
+            set job answers "ok" when the daemon's tag configuration
+            has the given fingerprint. A keyed job is a source job
+            whose result is also stored under the 16 hex digit key in
+            the daemon's -cache directory, and fetch answers with the
+            stored result for a key, or "error 0 not cached." - this
+            pair is what -farm speaks. quit shuts the server down.
+
+        -farm <filepath>
+
+            Shard a -manifest batch across remote jsdev daemons. The
+            file names one node per line, host:port, each running
+            jsdev with the same tags, a numeric -server port, and a
+            -cache directory. For each entry the input's content key
+            is offered first, so a file the farm has seen before moves
+            no source bytes; only new content is sent, and the result
+            comes back to where the entry says. A node that stops
+            answering, or whose tag set differs, is dropped and its
+            share is processed locally, so a lost machine slows the
+            batch instead of breaking it. Does not combine with
+            -profile, -gzip, or -index.
+
+    With no -input, a program is read from stdin, and a modified program is
+    written to stdout. It will exit(1) if there is an error.
+*/
+
+#include "jsdev.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+#endif
+
+#define FALSE 0
+#define MAX_NR_PROFILES 16
+#define TRUE  1
+
+static jsdev* set;
+
+static int    nr_profiles;
+static char*  profile_names[MAX_NR_PROFILES];
+static jsdev* profile_sets[MAX_NR_PROFILES];
+
+static int    nr_inputs;
+static int    nr_jobs;
+static int    next_input;
+static char** inputs;
+static int    max_inputs;
+static char*  cache_dir;
+static char*  outdir;
+static char*  server_path;
+static char*  compile_path;
+static char*  manifest_path;
+
+static int    nr_args;
+static char** args;
+static int    max_args;
+
+/*
+    A manifest entry names one input, where its result goes, and which
+    tag set produces it: a profile number, or zero for the plain set.
+*/
+
+struct entry {
+    char* in_path;
+    char* out_path;
+    int   profile;
+    unsigned long long size;
+};
+
+static int    nr_entries;
+static int    next_entry;
+static struct entry* entries;
+static int    max_entries;
+
+static int watching = FALSE;
+static int split_input = FALSE;
+
+static char* farm_path;
+
+/*
+    One build farm node: where to connect, and whether it is still
+    answering. A node that stops answering is left alone and its share
+    of the batch is processed locally instead.
+*/
+
+struct node {
+    char* spec;
+    int   alive;
+};
+
+static int nr_nodes;
+static struct node* nodes;
+static int max_nodes;
+
+#define NODE_DOWN (-2)
+
+static int pipelining = FALSE;
+static int outmapping = FALSE;
+static int indexing = FALSE;
+static int strip_level = 0;
+static int gzipping = FALSE;
+static int stats_wanted = FALSE;
+static jsdev_stats total_stats;
+
+static pthread_mutex_t job_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int nr_failures;
+
+static void
+note_failure(void)
+{
+/*
+    Count a failed file. The batch keeps going - each failure has been
+    reported with its file and line already - and the count decides the
+    summary and the exit status at the end.
+*/
+    pthread_mutex_lock(&job_mutex);
+    nr_failures += 1;
+    pthread_mutex_unlock(&job_mutex);
+}
+
+
+static int
+batch_status(void)
+{
+/*
+    Summarize a finished batch and turn it into an exit status: the work
+    that succeeded is on disk either way, so CI reprocesses only what
+    actually failed.
+*/
+    if (nr_failures > 0) {
+        fprintf(stderr, "JSDev: %d file%s failed.\r\n", nr_failures,
+            nr_failures == 1 ? "" : "s");
+        return 1;
+    }
+    return 0;
+}
+
+static void
+die(char* message)
+{
+    fputs("JSDev: bad method line ", stderr);
+    fputs(message, stderr);
+    fputs("\r\n", stderr);
+    exit(1);
+}
+
+
+static void
+complain(jsdev_context* ctx, char* path)
+{
+/*
+    Report a processing failure the way the filter always has: the file,
+    the line, the message.
+*/
+    fputs("JSDev: ", stderr);
+    if (path != NULL) {
+        fputs(path, stderr);
+        fputs(": ", stderr);
+    }
+    if (jsdev_line(ctx)) {
+        fprintf(stderr, "%d. ", jsdev_line(ctx));
+    }
+    fputs(jsdev_message(ctx), stderr);
+    fputs("\r\n", stderr);
+}
+
+
+static void
+die_in_file(jsdev_context* ctx, char* path)
+{
+    complain(ctx, path);
+    exit(1);
+}
+
+
+static char*
+output_path(char* path)
+{
+/*
+    Build the name of the place where an input file's result goes: a file
+    of the same name under -outdir, or NULL meaning stdout.
+*/
+    char* name;
+    char* out_path;
+
+    if (outdir == NULL) {
+        return NULL;
+    }
+    name = strrchr(path, '/');
+    name = name == NULL ? path : name + 1;
+    out_path = malloc(strlen(outdir) + strlen(name) + 5);
+    if (out_path == NULL) {
+        die("out of memory.");
+    }
+    strcpy(out_path, outdir);
+    strcat(out_path, "/");
+    strcat(out_path, name);
+    if (gzipping) {
+        strcat(out_path, ".gz");
+    }
+    return out_path;
+}
+
+
+static FILE*
+open_output(char* path)
+{
+    char* out_path = output_path(path);
+    FILE* out;
+
+    if (out_path == NULL) {
+        return stdout;
+    }
+    out = fopen(out_path, "wb");
+    if (out == NULL) {
+        fputs("JSDev: ", stderr);
+        fputs(out_path, stderr);
+        fputs(": cannot open output file.\r\n", stderr);
+        exit(1);
+    }
+    free(out_path);
+    return out;
+}
+
+
+static FILE*
+open_index(char* out_path)
+{
+/*
+    Open the expansion span index sidecar next to an output file: the
+    same name with .idx appended.
+*/
+    char* idx_path;
+    FILE* index;
+
+    idx_path = malloc(strlen(out_path) + 5);
+    if (idx_path == NULL) {
+        die("out of memory.");
+    }
+    strcpy(idx_path, out_path);
+    strcat(idx_path, ".idx");
+    index = fopen(idx_path, "wb");
+    if (index == NULL) {
+        fputs("JSDev: ", stderr);
+        fputs(idx_path, stderr);
+        fputs(": cannot open index file.\r\n", stderr);
+        exit(1);
+    }
+    free(idx_path);
+    return index;
+}
+
+
+static void
+copy_file(char* from_path, FILE* to)
+{
+    char buffer[65536];
+    size_t length;
+    FILE* from = fopen(from_path, "rb");
+    if (from == NULL) {
+        die("cannot read cache entry.");
+    }
+    while ((length = fread(buffer, 1, sizeof buffer, from)) > 0) {
+        if (fwrite(buffer, 1, length, to) != length) {
+            die("write error.");
+        }
+    }
+    fclose(from);
+}
+
+
+static unsigned long long
+configuration(void)
+{
+/*
+    The fingerprint of everything that shapes the output: the tag set,
+    and the strip level, which the set's own fingerprint cannot see. A
+    cache entry, and a farm node's answer, are only good for both.
+*/
+    unsigned char level = (unsigned char)strip_level;
+
+    return jsdev_hash(jsdev_fingerprint(set), &level, 1);
+}
+
+
+static int
+cache_key(char* path, unsigned long long* key)
+{
+/*
+    Hash the input content over the tag set's fingerprint. Return FALSE if
+    the file cannot be mapped, in which case the cache is skipped.
+*/
+    int file;
+    struct stat status;
+    void* map;
+
+    file = open(path, O_RDONLY);
+    if (file < 0 || fstat(file, &status) != 0
+            || !S_ISREG(status.st_mode)) {
+        if (file >= 0) {
+            close(file);
+        }
+        return FALSE;
+    }
+    *key = configuration();
+    if (status.st_size > 0) {
+        map = mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_PRIVATE,
+            file, 0);
+        if (map == MAP_FAILED) {
+            close(file);
+            return FALSE;
+        }
+        *key = jsdev_hash(*key, map, (size_t)status.st_size);
+        munmap(map, (size_t)status.st_size);
+    }
+    close(file);
+    return TRUE;
+}
+
+
+static int
+run_one(jsdev_context* ctx, char* path, FILE* out)
+{
+/*
+    Scan one file into an open output, splitting a lone large input
+    across the otherwise idle cores.
+*/
+    int workers;
+
+    if (nr_inputs != 1 && !split_input) {
+        return jsdev_file(ctx, path, out);
+    }
+    workers = nr_jobs;
+    if (workers == 0) {
+        workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (workers < 2) {
+        return jsdev_file(ctx, path, out);
+    }
+    return jsdev_parallel_file(ctx, path, out, workers);
+}
+
+
+static int
+one_file(jsdev_context* ctx, char* path)
+{
+/*
+    Process one input file, returning 0 or EOF after reporting a failure.
+    With -cache, the result is produced into the cache under its content
+    key the first time - built in a temporary file and renamed, so
+    half-written entries are never seen - and delivered from there by
+    hardlink or copy from then on.
+*/
+    char* out_path;
+    char cache_path[4096];
+    char temp_path[4096];
+    int failed;
+    int file;
+    unsigned long long key;
+    FILE* index;
+    FILE* out;
+
+    if (cache_dir == NULL || !cache_key(path, &key)) {
+        out = open_output(path);
+        index = NULL;
+        if (indexing) {
+            out_path = output_path(path);
+            index = open_index(out_path);
+            free(out_path);
+            jsdev_index(ctx, index);
+        }
+        failed = run_one(ctx, path, out) != 0;
+        if (index != NULL) {
+            jsdev_index(ctx, NULL);
+            fclose(index);
+        }
+        if (out != stdout) {
+            fclose(out);
+        }
+        if (failed) {
+            complain(ctx, path);
+            return EOF;
+        }
+        return 0;
+    }
+    snprintf(cache_path, sizeof cache_path, "%s/%016llx", cache_dir, key);
+    if (access(cache_path, R_OK) != 0) {
+        snprintf(temp_path, sizeof temp_path, "%s/workXXXXXX", cache_dir);
+        file = mkstemp(temp_path);
+        out = file < 0 ? NULL : fdopen(file, "wb");
+        if (out == NULL) {
+            die("cannot write cache entry.");
+        }
+        if (run_one(ctx, path, out) != 0) {
+            fclose(out);
+            unlink(temp_path);
+            complain(ctx, path);
+            return EOF;
+        }
+        fclose(out);
+        if (rename(temp_path, cache_path) != 0) {
+            unlink(temp_path);
+            die("cannot write cache entry.");
+        }
+    }
+    out_path = output_path(path);
+    if (out_path == NULL) {
+        copy_file(cache_path, stdout);
+    } else {
+        unlink(out_path);
+        if (link(cache_path, out_path) != 0) {
+            out = fopen(out_path, "wb");
+            if (out == NULL) {
+                die("cannot open output file.");
+            }
+            copy_file(cache_path, out);
+            fclose(out);
+        }
+        free(out_path);
+    }
+    return 0;
+}
+
+
+static FILE*
+open_profile_output(int p, char* path)
+{
+/*
+    Open the place where one profile's result for an input file goes: a
+    file of the same name under the profile's directory in -outdir.
+*/
+    char out_path[4096];
+    char* name;
+    FILE* out;
+
+    name = strrchr(path, '/');
+    name = name == NULL ? path : name + 1;
+    snprintf(out_path, sizeof out_path, "%s/%s/%s%s", outdir,
+        profile_names[p], name, gzipping ? ".gz" : "");
+    out = fopen(out_path, "wb");
+    if (out == NULL) {
+        fputs("JSDev: ", stderr);
+        fputs(out_path, stderr);
+        fputs(": cannot open output file.\r\n", stderr);
+        exit(1);
+    }
+    return out;
+}
+
+
+static int
+fan_file(jsdev_context* ctx, char* path)
+{
+/*
+    Process one input file for every profile in a single scan, returning
+    0 or EOF after reporting a failure.
+*/
+    int k, result;
+    FILE* outs[MAX_NR_PROFILES];
+
+    for (k = 0; k < nr_profiles; k += 1) {
+        outs[k] = open_profile_output(k, path);
+    }
+    result = jsdev_fanout_file(ctx, path, outs);
+    for (k = 0; k < nr_profiles; k += 1) {
+        fclose(outs[k]);
+    }
+    if (result != 0) {
+        complain(ctx, path);
+    }
+    return result;
+}
+
+
+static void
+merge_stats(jsdev_stats* mine)
+{
+/*
+    Fold one worker's counters into the totals.
+*/
+    int t;
+    if (!stats_wanted) {
+        return;
+    }
+    pthread_mutex_lock(&stats_mutex);
+    total_stats.bytes += mine->bytes;
+    total_stats.lines += mine->lines;
+    total_stats.comments += mine->comments;
+    total_stats.matches += mine->matches;
+    total_stats.literal_bytes += mine->literal_bytes;
+    total_stats.process_seconds += mine->process_seconds;
+    total_stats.string_seconds += mine->string_seconds;
+    total_stats.regexp_seconds += mine->regexp_seconds;
+    total_stats.expand_seconds += mine->expand_seconds;
+    if (total_stats.tag_matches != NULL && mine->tag_matches != NULL) {
+        for (t = 0; t < jsdev_nr_tags(set); t += 1) {
+            total_stats.tag_matches[t] += mine->tag_matches[t];
+        }
+    }
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+
+static void
+print_stats(void)
+{
+    int t;
+    fprintf(stderr, "JSDev: stats bytes=%llu lines=%llu comments=%llu"
+        " matches=%llu literal_bytes=%llu process=%.6f string=%.6f"
+        " regexp=%.6f expand=%.6f",
+        total_stats.bytes, total_stats.lines, total_stats.comments,
+        total_stats.matches, total_stats.literal_bytes,
+        total_stats.process_seconds, total_stats.string_seconds,
+        total_stats.regexp_seconds, total_stats.expand_seconds);
+    if (set != NULL && total_stats.tag_matches != NULL) {
+        for (t = 0; t < jsdev_nr_tags(set); t += 1) {
+            fprintf(stderr, " tag.%s=%llu", jsdev_tag(set, t),
+                total_stats.tag_matches[t]);
+        }
+    }
+    fputs("\n", stderr);
+}
+
+
+static jsdev_context*
+make_context()
+{
+/*
+    Make the kind of context the method line calls for: a fan out context
+    when there are profiles, an ordinary one otherwise.
+*/
+    jsdev_context* ctx = nr_profiles > 0
+        ? jsdev_fanout_make(nr_profiles, profile_sets)
+        : jsdev_context_make(set);
+    if (ctx == NULL) {
+        die("out of memory.");
+    }
+    if (pipelining && jsdev_pipeline(ctx, TRUE) != 0) {
+        die("out of memory.");
+    }
+    if (outmapping) {
+        jsdev_outmap(ctx, TRUE);
+    }
+    jsdev_strip(ctx, strip_level);
+    if (gzipping && jsdev_gzip(ctx, TRUE) != 0) {
+        die("out of memory.");
+    }
+    return ctx;
+}
+
+
+/*
+    The batch scheduler's view of one input file, for the largest first
+    sort.
+*/
+
+struct load {
+    char* path;
+    unsigned long long size;
+};
+
+
+static int
+heavier(const void* a, const void* b)
+{
+    const struct load* x = a;
+    const struct load* y = b;
+    return x->size < y->size ? 1 : x->size > y->size ? -1 : 0;
+}
+
+
+static int
+schedule_inputs(void)
+{
+/*
+    Order the input files largest first, so the long scans start while
+    the pool is still full and the small files pack the tail, and count
+    the leading files that are bigger than a fair share of the whole
+    batch. Each of those would bound the batch on one core, so the
+    caller runs them through the intra file parallel scanner instead of
+    handing them to one pool worker. A file that cannot be statted
+    sorts last and fails later, where its failure is reported.
+*/
+    int i, nr_huge = 0;
+    unsigned long long total = 0;
+    struct load* loads;
+    struct stat status;
+
+    loads = malloc((size_t)nr_inputs * sizeof (struct load));
+    if (loads == NULL) {
+        die("out of memory.");
+    }
+    for (i = 0; i < nr_inputs; i += 1) {
+        loads[i].path = inputs[i];
+        loads[i].size = stat(inputs[i], &status) == 0
+            ? (unsigned long long)status.st_size : 0;
+        total += loads[i].size;
+    }
+    qsort(loads, (size_t)nr_inputs, sizeof (struct load), heavier);
+    for (i = 0; i < nr_inputs; i += 1) {
+        inputs[i] = loads[i].path;
+    }
+    while (nr_huge < nr_inputs
+            && loads[nr_huge].size * (unsigned long long)nr_jobs > total) {
+        nr_huge += 1;
+    }
+    free(loads);
+    return nr_huge;
+}
+
+
+static void*
+work(void* unused)
+{
+/*
+    A worker thread: take the next unclaimed input file, process it, and
+    go back for another until the list is empty.
+*/
+    int i;
+    jsdev_stats mine;
+    jsdev_context* ctx = make_context();
+    (void)unused;
+    memset(&mine, 0, sizeof mine);
+    if (stats_wanted) {
+        if (set != NULL) {
+            mine.tag_matches = calloc((size_t)jsdev_nr_tags(set) + 1,
+                sizeof (unsigned long long));
+        }
+        jsdev_collect(ctx, &mine);
+    }
+    for (;;) {
+        pthread_mutex_lock(&job_mutex);
+        i = next_input;
+        next_input += 1;
+        pthread_mutex_unlock(&job_mutex);
+        if (i >= nr_inputs) {
+            merge_stats(&mine);
+            return NULL;
+        }
+        if ((nr_profiles > 0 ? fan_file(ctx, inputs[i])
+                : one_file(ctx, inputs[i])) != 0) {
+            note_failure();
+        }
+    }
+}
+
+
+static void
+run_watch()
+{
+/*
+    Stay resident and reprocess an input file whenever it changes,
+    comparing modification time and size. On Linux, inotify watches on
+    the inputs' directories say when to look; elsewhere the inputs are
+    polled a few times a second. Watching directories rather than files
+    survives editors that save by renaming a fresh file into place.
+*/
+    int i;
+    struct stat status;
+    time_t* mtimes;
+    off_t* sizes;
+    jsdev_context* ctx;
+#if defined(__linux__)
+    int notify;
+    char events[4096];
+    char* slash;
+    char* parent;
+#endif
+
+    mtimes = calloc((size_t)nr_inputs, sizeof (time_t));
+    sizes = calloc((size_t)nr_inputs, sizeof (off_t));
+    if (mtimes == NULL || sizes == NULL) {
+        die("out of memory.");
+    }
+    ctx = make_context();
+    for (i = 0; i < nr_inputs; i += 1) {
+        if (stat(inputs[i], &status) == 0) {
+            mtimes[i] = status.st_mtime;
+            sizes[i] = status.st_size;
+        }
+    }
+#if defined(__linux__)
+    notify = inotify_init();
+    if (notify >= 0) {
+        for (i = 0; i < nr_inputs; i += 1) {
+            slash = strrchr(inputs[i], '/');
+            if (slash == NULL) {
+                parent = ".";
+            } else {
+                parent = strndup(inputs[i], (size_t)(slash - inputs[i]));
+                if (parent == NULL) {
+                    die("out of memory.");
+                }
+            }
+            inotify_add_watch(notify, parent,
+                IN_CLOSE_WRITE | IN_CREATE | IN_MOVED_TO);
+            if (slash != NULL) {
+                free(parent);
+            }
+        }
+    }
+#endif
+    fprintf(stderr, "JSDev: watching %d files.\n", nr_inputs);
+    for (;;) {
+#if defined(__linux__)
+        if (notify >= 0) {
+            if (read(notify, events, sizeof events) <= 0) {
+                continue;
+            }
+        } else {
+            usleep(250000);
+        }
+#else
+        usleep(250000);
+#endif
+        for (i = 0; i < nr_inputs; i += 1) {
+            if (stat(inputs[i], &status) != 0) {
+                continue;
+            }
+            if (status.st_mtime != mtimes[i] || status.st_size != sizes[i]) {
+                mtimes[i] = status.st_mtime;
+                sizes[i] = status.st_size;
+                if (one_file(ctx, inputs[i]) == 0) {
+                    fprintf(stderr, "JSDev: updated %s\n", inputs[i]);
+                }
+            }
+        }
+    }
+}
+
+
+static int
+is_port(char* text)
+{
+/*
+    Is the -server argument a TCP port number rather than a socket path?
+*/
+    return text[0] != 0 && strspn(text, "0123456789") == strlen(text);
+}
+
+
+static void
+serve(int connection)
+{
+/*
+    Handle one connection: read the job line, run the job, and answer with
+    the outcome. A source job's result is built in memory so its length
+    can be announced first.
+*/
+    char buffer[65536];
+    char cache_path[4096];
+    char command[4096];
+    char temp_path[4096];
+    char* body = NULL;
+    char* in_path;
+    char* key_text;
+    char* out_path;
+    char* rest;
+    char* result;
+    int file;
+    size_t length, piece, result_length;
+    FILE* from;
+    FILE* out;
+    FILE* sock;
+    jsdev_context* ctx;
+
+    sock = fdopen(connection, "r+b");
+    if (sock == NULL) {
+        close(connection);
+        return;
+    }
+    if (fgets(command, sizeof command, sock) == NULL) {
+        fclose(sock);
+        return;
+    }
+    command[strcspn(command, "\r\n")] = 0;
+    ctx = jsdev_context_make(set);
+    if (ctx == NULL) {
+        fputs("error 0 out of memory.\n", sock);
+        fclose(sock);
+        return;
+    }
+    jsdev_strip(ctx, strip_level);
+    if (strncmp(command, "file ", 5) == 0) {
+        in_path = command + 5;
+        out_path = strchr(in_path, ' ');
+        if (out_path == NULL) {
+            fputs("error 0 bad job line.\n", sock);
+        } else {
+            *out_path = 0;
+            out_path += 1;
+            out = fopen(out_path, "wb");
+            if (out == NULL) {
+                fputs("error 0 cannot open output file.\n", sock);
+            } else if (jsdev_file(ctx, in_path, out) != 0) {
+                fclose(out);
+                fprintf(sock, "error %d %s\n", jsdev_line(ctx),
+                    jsdev_message(ctx));
+            } else {
+                fclose(out);
+                fputs("ok\n", sock);
+            }
+        }
+    } else if (strncmp(command, "source ", 7) == 0) {
+        length = strtoul(command + 7, NULL, 10);
+        body = malloc(length == 0 ? 1 : length);
+        if (body == NULL || fread(body, 1, length, sock) != length) {
+            fputs("error 0 bad job body.\n", sock);
+        } else if (jsdev_transform(ctx, body, length,
+                &result, &result_length) != 0) {
+            fprintf(sock, "error %d %s\n", jsdev_line(ctx),
+                jsdev_message(ctx));
+        } else {
+            fprintf(sock, "ok %lu\n", (unsigned long)result_length);
+            fwrite(result, 1, result_length, sock);
+            free(result);
+        }
+        free(body);
+    } else if (strncmp(command, "set ", 4) == 0) {
+/*
+    A farm coordinator checks that this daemon expands with the same tag
+    set before handing over any work.
+*/
+        if (strtoull(command + 4, NULL, 16) == configuration()) {
+            fputs("ok\n", sock);
+        } else {
+            fputs("error 0 tag set differs.\n", sock);
+        }
+    } else if (strncmp(command, "fetch ", 6) == 0) {
+/*
+    Serve a result this daemon already built, by its content key. A miss
+    is an ordinary answer: the coordinator sends the source next.
+*/
+        key_text = command + 6;
+        from = NULL;
+        if (cache_dir != NULL
+                && strspn(key_text, "0123456789abcdef") == 16
+                && key_text[16] == 0) {
+            snprintf(cache_path, sizeof cache_path, "%s/%s", cache_dir,
+                key_text);
+            from = fopen(cache_path, "rb");
+        }
+        if (from == NULL) {
+            fputs("error 0 not cached.\n", sock);
+        } else {
+            fseek(from, 0, SEEK_END);
+            length = (size_t)ftell(from);
+            rewind(from);
+            fprintf(sock, "ok %lu\n", (unsigned long)length);
+            while ((piece = fread(buffer, 1, sizeof buffer, from)) > 0) {
+                fwrite(buffer, 1, piece, sock);
+            }
+            fclose(from);
+        }
+    } else if (strncmp(command, "keyed ", 6) == 0) {
+/*
+    A coordinator's job: the content key, the source length, and the
+    source bytes. The result is answered like a source job and kept in
+    the cache under the key, so the next build of unchanged content
+    moves no source bytes at all.
+*/
+        key_text = command + 6;
+        rest = strchr(key_text, ' ');
+        if (rest == NULL) {
+            fputs("error 0 bad job line.\n", sock);
+        } else {
+            *rest = 0;
+            length = strtoul(rest + 1, NULL, 10);
+            body = malloc(length == 0 ? 1 : length);
+            if (body == NULL || fread(body, 1, length, sock) != length) {
+                fputs("error 0 bad job body.\n", sock);
+            } else if (jsdev_transform(ctx, body, length,
+                    &result, &result_length) != 0) {
+                fprintf(sock, "error %d %s\n", jsdev_line(ctx),
+                    jsdev_message(ctx));
+            } else {
+                fprintf(sock, "ok %lu\n", (unsigned long)result_length);
+                fwrite(result, 1, result_length, sock);
+                if (cache_dir != NULL
+                        && strspn(key_text, "0123456789abcdef") == 16
+                        && key_text[16] == 0) {
+                    snprintf(temp_path, sizeof temp_path,
+                        "%s/workXXXXXX", cache_dir);
+                    file = mkstemp(temp_path);
+                    out = file < 0 ? NULL : fdopen(file, "wb");
+                    if (out != NULL) {
+                        snprintf(cache_path, sizeof cache_path, "%s/%s",
+                            cache_dir, key_text);
+                        if (fwrite(result, 1, result_length, out)
+                                    == result_length
+                                && fclose(out) == 0) {
+                            if (rename(temp_path, cache_path) != 0) {
+                                unlink(temp_path);
+                            }
+                        } else {
+                            unlink(temp_path);
+                        }
+                    }
+                }
+                free(result);
+            }
+            free(body);
+        }
+    } else if (strcmp(command, "quit") == 0) {
+        fputs("ok\n", sock);
+        fclose(sock);
+        jsdev_context_free(ctx);
+        if (!is_port(server_path)) {
+            unlink(server_path);
+        }
+        exit(0);
+    } else {
+        fputs("error 0 unknown job.\n", sock);
+    }
+    fclose(sock);
+    jsdev_context_free(ctx);
+}
+
+
+static void*
+serve_thread(void* arg)
+{
+    serve((int)(long)arg);
+    return NULL;
+}
+
+
+static void
+run_server(char* path)
+{
+/*
+    Stay resident and hand each accepted connection to its own thread, so
+    a slow job does not hold up the build tool's other requests.
+*/
+    int connection, one = 1, sock;
+    struct sockaddr_in inet_address;
+    struct sockaddr_un address;
+    pthread_t thread;
+    pthread_attr_t detached;
+
+/*
+    A client that vanishes mid reply must cost its connection, not the
+    daemon: take the write error instead of the signal.
+*/
+    signal(SIGPIPE, SIG_IGN);
+    if (is_port(path)) {
+/*
+    A numeric argument asks for a TCP port, so farm coordinators on
+    other machines can reach this daemon.
+*/
+        sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0) {
+            die("cannot create server socket.");
+        }
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+        memset(&inet_address, 0, sizeof inet_address);
+        inet_address.sin_family = AF_INET;
+        inet_address.sin_addr.s_addr = htonl(INADDR_ANY);
+        inet_address.sin_port = htons((unsigned short)atoi(path));
+        if (bind(sock, (struct sockaddr*)&inet_address,
+                    sizeof inet_address) != 0
+                || listen(sock, 64) != 0) {
+            die("cannot create server socket.");
+        }
+    } else {
+        sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sock < 0 || strlen(path) >= sizeof address.sun_path) {
+            die("cannot create server socket.");
+        }
+        memset(&address, 0, sizeof address);
+        address.sun_family = AF_UNIX;
+        strcpy(address.sun_path, path);
+        unlink(path);
+        if (bind(sock, (struct sockaddr*)&address, sizeof address) != 0
+                || listen(sock, 64) != 0) {
+            die("cannot create server socket.");
+        }
+    }
+    pthread_attr_init(&detached);
+    pthread_attr_setdetachstate(&detached, PTHREAD_CREATE_DETACHED);
+    for (;;) {
+        connection = accept(sock, NULL, NULL);
+        if (connection < 0) {
+            continue;
+        }
+        if (pthread_create(&thread, &detached, serve_thread,
+                (void*)(long)connection) != 0) {
+            close(connection);
+        }
+    }
+}
+
+
+static void
+add_input(char* path)
+{
+    if (nr_inputs >= max_inputs) {
+        max_inputs = max_inputs == 0 ? 16 : max_inputs * 2;
+        inputs = realloc(inputs, (size_t)max_inputs * sizeof (char*));
+        if (inputs == NULL) {
+            die("out of memory.");
+        }
+    }
+    inputs[nr_inputs] = path;
+    nr_inputs += 1;
+}
+
+
+static void
+add_arg(char* arg)
+{
+    if (nr_args >= max_args) {
+        max_args = max_args == 0 ? 64 : max_args * 2;
+        args = realloc(args, (size_t)max_args * sizeof (char*));
+        if (args == NULL) {
+            die("out of memory.");
+        }
+    }
+    args[nr_args] = arg;
+    nr_args += 1;
+}
+
+
+static void
+response_file(char* path)
+{
+/*
+    Append the whitespace separated tokens of a response file to the
+    argument list, so a build system can hand over an arbitrarily long
+    method line as @args.rsp. A token starting with # discards the rest
+    of its line, and a token starting with @ names a nested response
+    file. The text stays allocated for the life of the process, since
+    the arguments point into it.
+*/
+    char* at;
+    char* text;
+    char* token;
+    int ended;
+    long length;
+    FILE* file = fopen(path, "rb");
+
+    if (file == NULL || fseek(file, 0, SEEK_END) != 0
+            || (length = ftell(file)) < 0
+            || fseek(file, 0, SEEK_SET) != 0) {
+        die("cannot read response file.");
+    }
+    text = malloc((size_t)length + 1);
+    if (text == NULL) {
+        die("out of memory.");
+    }
+    if (fread(text, 1, (size_t)length, file) != (size_t)length) {
+        die("cannot read response file.");
+    }
+    fclose(file);
+    text[length] = 0;
+    at = text;
+    for (;;) {
+        while (*at == ' ' || *at == '\t' || *at == '\n' || *at == '\r') {
+            at += 1;
+        }
+        if (*at == 0) {
+            return;
+        }
+        if (*at == '#') {
+            while (*at != 0 && *at != '\n') {
+                at += 1;
+            }
+            continue;
+        }
+        token = at;
+        while (*at != 0 && *at != ' ' && *at != '\t' && *at != '\n'
+                && *at != '\r') {
+            at += 1;
+        }
+        ended = *at;
+        *at = 0;
+        if (token[0] == '@') {
+            response_file(token + 1);
+        } else {
+            add_arg(token);
+        }
+        if (ended == 0) {
+            return;
+        }
+        at += 1;
+    }
+}
+
+
+static void
+read_manifest(char* path)
+{
+/*
+    Read the batch manifest: one entry per line, an input path, an
+    output path, and optionally the name of the profile whose tag set
+    applies. Blank lines and lines starting with # are skipped.
+*/
+    char line[8192];
+    char* in_path;
+    char* out_path;
+    char* profile;
+    int p;
+    FILE* file = fopen(path, "rb");
+
+    if (file == NULL) {
+        die("cannot read manifest.");
+    }
+    while (fgets(line, sizeof line, file) != NULL) {
+        in_path = strtok(line, " \t\r\n");
+        if (in_path == NULL || in_path[0] == '#') {
+            continue;
+        }
+        out_path = strtok(NULL, " \t\r\n");
+        if (out_path == NULL) {
+            die("manifest entry needs an output path.");
+        }
+        profile = strtok(NULL, " \t\r\n");
+        p = 0;
+        if (profile != NULL) {
+            while (p < nr_profiles
+                    && strcmp(profile_names[p], profile) != 0) {
+                p += 1;
+            }
+            if (p >= nr_profiles) {
+                die("unknown profile in manifest.");
+            }
+            p += 1;
+        } else if (set == NULL) {
+            die("manifest entry needs a profile.");
+        }
+        if (nr_entries >= max_entries) {
+            max_entries = max_entries == 0 ? 256 : max_entries * 2;
+            entries = realloc(entries,
+                (size_t)max_entries * sizeof (struct entry));
+            if (entries == NULL) {
+                die("out of memory.");
+            }
+        }
+        entries[nr_entries].in_path = strdup(in_path);
+        entries[nr_entries].out_path = strdup(out_path);
+        entries[nr_entries].profile = p;
+        if (entries[nr_entries].in_path == NULL
+                || entries[nr_entries].out_path == NULL) {
+            die("out of memory.");
+        }
+        nr_entries += 1;
+    }
+    fclose(file);
+}
+
+
+static int
+heavier_entry(const void* a, const void* b)
+{
+    const struct entry* x = a;
+    const struct entry* y = b;
+    return x->size < y->size ? 1 : x->size > y->size ? -1 : 0;
+}
+
+
+static void*
+manifest_work(void* unused)
+{
+/*
+    A worker thread for the manifest batch: take the next unclaimed
+    entry, process it with a context for its tag set, and go back for
+    another until the batch is done. Contexts are made lazily, one per
+    tag set the worker actually meets.
+*/
+    int i, p;
+    jsdev_stats mine;
+    jsdev_context* ctxs[MAX_NR_PROFILES + 1] = {NULL};
+    struct entry* job;
+    FILE* index;
+    FILE* out;
+
+    (void)unused;
+    memset(&mine, 0, sizeof mine);
+    if (stats_wanted && set != NULL) {
+        mine.tag_matches = calloc((size_t)jsdev_nr_tags(set) + 1,
+            sizeof (unsigned long long));
+    }
+    for (;;) {
+        pthread_mutex_lock(&job_mutex);
+        i = next_entry;
+        next_entry += 1;
+        pthread_mutex_unlock(&job_mutex);
+        if (i >= nr_entries) {
+            merge_stats(&mine);
+            return NULL;
+        }
+        job = entries + i;
+        p = job->profile;
+        if (ctxs[p] == NULL) {
+            ctxs[p] = jsdev_context_make(p == 0 ? set
+                : profile_sets[p - 1]);
+            if (ctxs[p] == NULL
+                    || (pipelining && jsdev_pipeline(ctxs[p], TRUE) != 0)) {
+                die("out of memory.");
+            }
+            if (outmapping) {
+                jsdev_outmap(ctxs[p], TRUE);
+            }
+            jsdev_strip(ctxs[p], strip_level);
+            if (gzipping && jsdev_gzip(ctxs[p], TRUE) != 0) {
+                die("out of memory.");
+            }
+            if (stats_wanted) {
+                jsdev_collect(ctxs[p], &mine);
+            }
+        }
+        out = fopen(job->out_path, "wb");
+        if (out == NULL) {
+            fputs("JSDev: ", stderr);
+            fputs(job->out_path, stderr);
+            fputs(": cannot open output file.\r\n", stderr);
+            note_failure();
+            continue;
+        }
+        index = NULL;
+        if (indexing) {
+            index = open_index(job->out_path);
+            jsdev_index(ctxs[p], index);
+        }
+        if (jsdev_file(ctxs[p], job->in_path, out) != 0) {
+            complain(ctxs[p], job->in_path);
+            note_failure();
+        }
+        if (index != NULL) {
+            jsdev_index(ctxs[p], NULL);
+            fclose(index);
+        }
+        fclose(out);
+    }
+}
+
+
+static void
+run_manifest(void)
+{
+/*
+    Execute the whole manifest batch with a pool of workers, the same
+    shape as the input file pool.
+*/
+    int i;
+    pthread_t* threads;
+    struct stat status;
+
+    if (nr_jobs == 0) {
+        nr_jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (nr_jobs < 1) {
+            nr_jobs = 1;
+        }
+    }
+    if (nr_jobs > nr_entries) {
+        nr_jobs = nr_entries;
+    }
+    if (nr_jobs < 1) {
+        return;
+    }
+    for (i = 0; i < nr_entries; i += 1) {
+        entries[i].size = stat(entries[i].in_path, &status) == 0
+            ? (unsigned long long)status.st_size : 0;
+    }
+    qsort(entries, (size_t)nr_entries, sizeof (struct entry),
+        heavier_entry);
+    threads = malloc((size_t)nr_jobs * sizeof (pthread_t));
+    if (threads == NULL) {
+        die("out of memory.");
+    }
+    for (i = 0; i < nr_jobs; i += 1) {
+        if (pthread_create(&threads[i], NULL, manifest_work, NULL) != 0) {
+            die("cannot start worker thread.");
+        }
+    }
+    for (i = 0; i < nr_jobs; i += 1) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+
+static void
+read_farm(char* path)
+{
+/*
+    Read the farm file: one node per line, host:port or just a port on
+    the local machine. Blank lines and lines starting with # are
+    skipped. The node list is small and lives as long as the batch.
+*/
+    char line[4096];
+    char* spec;
+    size_t length;
+    FILE* file = fopen(path, "rb");
+
+    if (file == NULL) {
+        die("cannot read farm file.");
+    }
+    while (fgets(line, sizeof line, file) != NULL) {
+        line[strcspn(line, "\r\n")] = 0;
+        spec = line + strspn(line, " \t");
+        if (spec[0] == 0 || spec[0] == '#') {
+            continue;
+        }
+        length = strlen(spec);
+        while (length > 0 && (spec[length - 1] == ' '
+                || spec[length - 1] == '\t')) {
+            length -= 1;
+            spec[length] = 0;
+        }
+        if (nr_nodes >= max_nodes) {
+            max_nodes = max_nodes == 0 ? 8 : max_nodes * 2;
+            nodes = realloc(nodes,
+                (size_t)max_nodes * sizeof (struct node));
+            if (nodes == NULL) {
+                die("out of memory.");
+            }
+        }
+        nodes[nr_nodes].spec = malloc(length + 1);
+        if (nodes[nr_nodes].spec == NULL) {
+            die("out of memory.");
+        }
+        strcpy(nodes[nr_nodes].spec, spec);
+        nodes[nr_nodes].alive = TRUE;
+        nr_nodes += 1;
+    }
+    fclose(file);
+}
+
+
+static FILE*
+connect_node(char* spec)
+{
+/*
+    Open a connection to one farm node. The spec is host:port, or just a
+    port on the local machine. Each job rides its own connection, the
+    way the daemon's other clients work.
+*/
+    char host[4096];
+    char* port;
+    int sock = -1;
+    struct addrinfo hints;
+    struct addrinfo* found;
+    struct addrinfo* it;
+    FILE* stream;
+
+    port = strrchr(spec, ':');
+    if (port == NULL) {
+        strcpy(host, "localhost");
+        port = spec;
+    } else {
+        if ((size_t)(port - spec) >= sizeof host) {
+            return NULL;
+        }
+        memcpy(host, spec, (size_t)(port - spec));
+        host[port - spec] = 0;
+        port += 1;
+    }
+    memset(&hints, 0, sizeof hints);
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &found) != 0) {
+        return NULL;
+    }
+    for (it = found; it != NULL; it = it->ai_next) {
+        sock = socket(it->ai_family, it->ai_socktype, it->ai_protocol);
+        if (sock < 0) {
+            continue;
+        }
+        if (connect(sock, it->ai_addr, it->ai_addrlen) == 0) {
+            break;
+        }
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(found);
+    if (sock < 0) {
+        return NULL;
+    }
+    stream = fdopen(sock, "r+b");
+    if (stream == NULL) {
+        close(sock);
+    }
+    return stream;
+}
+
+
+static int
+receive_result(FILE* sock, char* reply, char* in_path, char* out_path)
+{
+/*
+    Land a node's answer to one job. An ok reply carries the result
+    bytes, which go where the manifest entry says; an error reply is
+    reported the way a local failure would be. Anything else means the
+    node is gone.
+*/
+    char buffer[65536];
+    char* message;
+    long line;
+    size_t length, piece, want;
+    FILE* out;
+
+    if (strncmp(reply, "ok ", 3) == 0) {
+        length = strtoul(reply + 3, NULL, 10);
+        out = fopen(out_path, "wb");
+        if (out == NULL) {
+            fputs("JSDev: ", stderr);
+            fputs(out_path, stderr);
+            fputs(": cannot open output file.\r\n", stderr);
+            return EOF;
+        }
+        while (length > 0) {
+            want = length < sizeof buffer ? length : sizeof buffer;
+            piece = fread(buffer, 1, want, sock);
+            if (piece == 0) {
+                fclose(out);
+                return NODE_DOWN;
+            }
+            if (fwrite(buffer, 1, piece, out) != piece) {
+                fclose(out);
+                fputs("JSDev: ", stderr);
+                fputs(out_path, stderr);
+                fputs(": write error.\r\n", stderr);
+                return EOF;
+            }
+            length -= piece;
+        }
+        fclose(out);
+        return 0;
+    }
+    if (strncmp(reply, "error ", 6) == 0) {
+        reply[strcspn(reply, "\r\n")] = 0;
+        line = strtol(reply + 6, &message, 10);
+        fputs("JSDev: ", stderr);
+        fputs(in_path, stderr);
+        fputs(": ", stderr);
+        if (line != 0) {
+            fprintf(stderr, "%ld. ", line);
+        }
+        fputs(message + (message[0] == ' ' ? 1 : 0), stderr);
+        fputs("\r\n", stderr);
+        return EOF;
+    }
+    return NODE_DOWN;
+}
+
+
+static int
+farm_entry(char* spec, struct entry* job)
+{
+/*
+    Run one manifest entry on one farm node. The input's content key is
+    offered first, so a result the node already built moves no source
+    bytes at all; only a miss sends the program text. Returns 0, EOF for
+    a failure that has been reported, or NODE_DOWN when the node stopped
+    answering and the caller should take over.
+*/
+    char reply[4096];
+    int file, result;
+    size_t length;
+    struct stat status;
+    unsigned long long key;
+    void* map;
+    FILE* sock;
+
+    file = open(job->in_path, O_RDONLY);
+    if (file < 0 || fstat(file, &status) != 0
+            || !S_ISREG(status.st_mode)) {
+        if (file >= 0) {
+            close(file);
+        }
+        fputs("JSDev: ", stderr);
+        fputs(job->in_path, stderr);
+        fputs(": cannot open input file.\r\n", stderr);
+        return EOF;
+    }
+    length = (size_t)status.st_size;
+    map = length == 0 ? NULL
+        : mmap(NULL, length, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if (map == MAP_FAILED) {
+        fputs("JSDev: ", stderr);
+        fputs(job->in_path, stderr);
+        fputs(": cannot open input file.\r\n", stderr);
+        return EOF;
+    }
+    key = jsdev_hash(configuration(), map, length);
+    sock = connect_node(spec);
+    if (sock == NULL) {
+        result = NODE_DOWN;
+    } else {
+        fprintf(sock, "fetch %016llx\n", key);
+        fflush(sock);
+        if (fgets(reply, sizeof reply, sock) == NULL) {
+            result = NODE_DOWN;
+        } else if (strncmp(reply, "ok ", 3) == 0) {
+            result = receive_result(sock, reply, job->in_path,
+                job->out_path);
+        } else {
+            result = EOF;
+        }
+        fclose(sock);
+        if (result == EOF) {
+/*
+    A fetch miss is the ordinary cold case: send the source.
+*/
+            sock = connect_node(spec);
+            if (sock == NULL) {
+                result = NODE_DOWN;
+            } else {
+                fprintf(sock, "keyed %016llx %lu\n", key,
+                    (unsigned long)length);
+                if (length > 0) {
+                    fwrite(map, 1, length, sock);
+                }
+                fflush(sock);
+                result = fgets(reply, sizeof reply, sock) == NULL
+                    ? NODE_DOWN
+                    : receive_result(sock, reply, job->in_path,
+                        job->out_path);
+                fclose(sock);
+            }
+        }
+    }
+    if (map != NULL) {
+        munmap(map, length);
+    }
+    return result;
+}
+
+
+static void*
+farm_work(void* arg)
+{
+/*
+    The coordinator thread for one farm node: check that the node
+    expands with the same tag set, then feed it manifest entries until
+    the batch is done. A node that stops answering is dropped and its
+    thread processes its share locally, so a lost machine costs its
+    speed, never the batch.
+*/
+    char reply[4096];
+    int i, result;
+    struct node* mine = arg;
+    struct entry* job;
+    jsdev_context* ctx = NULL;
+    FILE* out;
+    FILE* sock;
+
+    sock = connect_node(mine->spec);
+    if (sock == NULL) {
+        mine->alive = FALSE;
+    } else {
+        fprintf(sock, "set %016llx\n", configuration());
+        fflush(sock);
+        if (fgets(reply, sizeof reply, sock) == NULL
+                || strncmp(reply, "ok", 2) != 0) {
+            mine->alive = FALSE;
+        }
+        fclose(sock);
+    }
+    if (!mine->alive) {
+        fputs("JSDev: ", stderr);
+        fputs(mine->spec, stderr);
+        fputs(": node lost; continuing locally.\r\n", stderr);
+    }
+    for (;;) {
+        pthread_mutex_lock(&job_mutex);
+        i = next_entry;
+        next_entry += 1;
+        pthread_mutex_unlock(&job_mutex);
+        if (i >= nr_entries) {
+            return NULL;
+        }
+        job = entries + i;
+        if (mine->alive) {
+            result = farm_entry(mine->spec, job);
+            if (result == NODE_DOWN) {
+                mine->alive = FALSE;
+                fputs("JSDev: ", stderr);
+                fputs(mine->spec, stderr);
+                fputs(": node lost; continuing locally.\r\n", stderr);
+            } else {
+                if (result != 0) {
+                    note_failure();
+                }
+                continue;
+            }
+        }
+        if (ctx == NULL) {
+            ctx = make_context();
+        }
+        out = fopen(job->out_path, "wb");
+        if (out == NULL) {
+            fputs("JSDev: ", stderr);
+            fputs(job->out_path, stderr);
+            fputs(": cannot open output file.\r\n", stderr);
+            note_failure();
+            continue;
+        }
+        if (jsdev_file(ctx, job->in_path, out) != 0) {
+            complain(ctx, job->in_path);
+            note_failure();
+        }
+        fclose(out);
+    }
+}
+
+
+static void
+run_farm(void)
+{
+/*
+    Shard the manifest across the farm: entries largest first, one
+    coordinator thread per node, each claiming the next entry the way
+    the local pools do. The threads are the scheduler; a slow node
+    simply claims fewer entries, and a dead one hands its share to its
+    own thread's local scan.
+*/
+    int i;
+    pthread_t* threads;
+    struct stat status;
+
+/*
+    A node that dies while source bytes are in flight must read as a
+    write error, so its thread can fall back to the local scan.
+*/
+    signal(SIGPIPE, SIG_IGN);
+    read_farm(farm_path);
+    if (nr_nodes < 1) {
+        die("the farm file names no nodes.");
+    }
+    for (i = 0; i < nr_entries; i += 1) {
+        entries[i].size = stat(entries[i].in_path, &status) == 0
+            ? (unsigned long long)status.st_size : 0;
+    }
+    qsort(entries, (size_t)nr_entries, sizeof (struct entry),
+        heavier_entry);
+    threads = malloc((size_t)nr_nodes * sizeof (pthread_t));
+    if (threads == NULL) {
+        die("out of memory.");
+    }
+    for (i = 0; i < nr_nodes; i += 1) {
+        if (pthread_create(&threads[i], NULL, farm_work,
+                nodes + i) != 0) {
+            die("cannot start worker thread.");
+        }
+    }
+    for (i = 0; i < nr_nodes; i += 1) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+
+extern int
+main(int argc, char* argv[])
+{
+    int bad_name, i, nr_comments = 0, nr_huge, nr_names = 0, nr_subset,
+        option = 0, p;
+    char dir_path[4096];
+    jsdev_stats huge_stats;
+    char** comments;
+    char** names;
+    char** subset;
+    int* name_profile;
+    pthread_t* threads;
+    jsdev_context* ctx;
+    FILE* generated;
+
+/*
+    Expand @response files first, so the parse below sees one flat
+    argument list wherever the tokens came from.
+*/
+    for (i = 1; i < argc; i += 1) {
+        if (argv[i][0] == '@') {
+            response_file(argv[i] + 1);
+        } else {
+            add_arg(argv[i]);
+        }
+    }
+    names = malloc(((size_t)nr_args + 1) * sizeof (char*));
+    comments = malloc(((size_t)nr_args + 1) * sizeof (char*));
+    subset = malloc(((size_t)nr_args + 1) * sizeof (char*));
+    name_profile = malloc(((size_t)nr_args + 1) * sizeof (int));
+    if (names == NULL || comments == NULL || subset == NULL
+            || name_profile == NULL) {
+        die("out of memory.");
+    }
+    for (i = 0; i < nr_args; i += 1) {
+        if (option == 'c') {
+            option = 0;
+            comments[nr_comments] = args[i];
+            nr_comments += 1;
+        } else if (option == 'i') {
+            option = 0;
+            add_input(args[i]);
+        } else if (option == 'j') {
+            option = 0;
+            nr_jobs = atoi(args[i]);
+            if (nr_jobs < 1) {
+                die(args[i]);
+            }
+        } else if (option == 'e') {
+            option = 0;
+            cache_dir = args[i];
+        } else if (option == 'o') {
+            option = 0;
+            outdir = args[i];
+        } else if (option == 'p') {
+            option = 0;
+            if (nr_profiles >= MAX_NR_PROFILES) {
+                die("too many profiles.");
+            }
+            profile_names[nr_profiles] = args[i];
+            nr_profiles += 1;
+        } else if (option == 's') {
+            option = 0;
+            server_path = args[i];
+        } else if (option == 'm') {
+            option = 0;
+            compile_path = args[i];
+        } else if (option == 'f') {
+            option = 0;
+            manifest_path = args[i];
+        } else if (option == 'a') {
+            option = 0;
+            farm_path = args[i];
+        } else if (strcmp(args[i], "-cache") == 0) {
+            option = 'e';
+        } else if (strcmp(args[i], "-comment") == 0) {
+            option = 'c';
+        } else if (strcmp(args[i], "-compile") == 0) {
+            option = 'm';
+        } else if (strcmp(args[i], "-input") == 0) {
+            option = 'i';
+        } else if (strcmp(args[i], "-jobs") == 0) {
+            option = 'j';
+        } else if (strcmp(args[i], "-farm") == 0) {
+            option = 'a';
+        } else if (strcmp(args[i], "-manifest") == 0) {
+            option = 'f';
+        } else if (strcmp(args[i], "-outdir") == 0) {
+            option = 'o';
+        } else if (strcmp(args[i], "-index") == 0) {
+            indexing = TRUE;
+        } else if (strcmp(args[i], "-gzip") == 0) {
+            gzipping = TRUE;
+        } else if (strcmp(args[i], "-strip") == 0) {
+            strip_level = strip_level < 1 ? 1 : strip_level;
+        } else if (strcmp(args[i], "-stripall") == 0) {
+            strip_level = 2;
+        } else if (strcmp(args[i], "-outmap") == 0) {
+            outmapping = TRUE;
+        } else if (strcmp(args[i], "-pipeline") == 0) {
+            pipelining = TRUE;
+        } else if (strcmp(args[i], "-profile") == 0) {
+            option = 'p';
+        } else if (strcmp(args[i], "-server") == 0) {
+            option = 's';
+        } else if (strcmp(args[i], "-stats") == 0) {
+            stats_wanted = TRUE;
+        } else if (strcmp(args[i], "-watch") == 0) {
+            watching = TRUE;
+        } else {
+            names[nr_names] = args[i];
+            name_profile[nr_names] = nr_profiles;
+            nr_names += 1;
+        }
+    }
+    if (option != 0) {
+        die(args[nr_args - 1]);
+    }
+    if (nr_inputs > 1 && outdir == NULL) {
+        die("-outdir is required with more than one -input.");
+    }
+    if (watching && (nr_inputs == 0 || outdir == NULL)) {
+        die("-watch requires -input and -outdir.");
+    }
+    if (manifest_path != NULL && (nr_inputs > 0 || cache_dir != NULL
+            || server_path != NULL || watching)) {
+        die("-manifest does not combine with -input, -cache, -server,"
+            " or -watch.");
+    }
+    if (indexing) {
+        if (outdir == NULL && manifest_path == NULL) {
+            die("-index requires -outdir or -manifest.");
+        }
+        if (cache_dir != NULL
+                || (nr_profiles > 0 && manifest_path == NULL)) {
+            die("-index does not combine with -cache or a -profile"
+                " batch.");
+        }
+    }
+    if (gzipping && (cache_dir != NULL || server_path != NULL
+            || indexing)) {
+        die("-gzip does not combine with -cache, -server, or -index.");
+    }
+    if (farm_path != NULL) {
+        if (manifest_path == NULL) {
+            die("-farm requires -manifest.");
+        }
+        if (nr_profiles > 0 || gzipping || indexing) {
+            die("-farm does not combine with -profile, -gzip, or"
+                " -index.");
+        }
+    }
+    if (nr_profiles > 0) {
+/*
+    Compile one tag set per profile from the shared tags and its own, and
+    make sure each profile's output directory exists. A manifest batch
+    places every output itself, so it needs neither -input nor -outdir.
+*/
+        if (manifest_path == NULL && (nr_inputs == 0 || outdir == NULL)) {
+            die("-profile requires -input and -outdir.");
+        }
+        if (cache_dir != NULL || server_path != NULL || watching) {
+            die("-profile does not combine with -cache, -server,"
+                " or -watch.");
+        }
+        for (p = 1; p <= nr_profiles; p += 1) {
+            nr_subset = 0;
+            for (i = 0; i < nr_names; i += 1) {
+                if (name_profile[i] == 0 || name_profile[i] == p) {
+                    subset[nr_subset] = names[i];
+                    nr_subset += 1;
+                }
+            }
+            profile_sets[p - 1] = jsdev_make(nr_subset, subset,
+                nr_comments, comments, &bad_name);
+            if (profile_sets[p - 1] == NULL) {
+                die(bad_name == EOF ? "out of memory." : subset[bad_name]);
+            }
+            snprintf(dir_path, sizeof dir_path, "%s/%s", outdir,
+                profile_names[p - 1]);
+            mkdir(dir_path, 0755);
+        }
+    } else {
+        set = jsdev_make(nr_names, names, nr_comments, comments, &bad_name);
+        if (set == NULL) {
+            die(bad_name == EOF ? "out of memory." : names[bad_name]);
+        }
+    }
+    if (compile_path != NULL) {
+/*
+    -compile writes the specialized filter source and does nothing else.
+*/
+        if (nr_profiles > 0 || nr_inputs > 0 || server_path != NULL
+                || watching || manifest_path != NULL) {
+            die("-compile only takes tags and -comment.");
+        }
+        generated = fopen(compile_path, "wb");
+        if (generated == NULL || jsdev_generate(set, generated) != 0
+                || fclose(generated) != 0) {
+            fputs("JSDev: ", stderr);
+            fputs(compile_path, stderr);
+            fputs(": cannot write generated source.\r\n", stderr);
+            return 1;
+        }
+        return 0;
+    }
+    if (server_path != NULL) {
+        run_server(server_path);
+    }
+    if (stats_wanted) {
+        if (set != NULL) {
+            total_stats.tag_matches = calloc((size_t)jsdev_nr_tags(set) + 1,
+                sizeof (unsigned long long));
+        }
+        atexit(print_stats);
+    }
+    if (manifest_path != NULL) {
+        read_manifest(manifest_path);
+        if (farm_path != NULL) {
+            run_farm();
+        } else {
+            run_manifest();
+        }
+        return batch_status();
+    }
+    if (nr_inputs == 0) {
+        ctx = make_context();
+        if (stats_wanted) {
+            jsdev_collect(ctx, &total_stats);
+        }
+        if (jsdev_stream(ctx, stdin, stdout) != 0) {
+            die_in_file(ctx, NULL);
+        }
+        return 0;
+    }
+    if (nr_inputs == 1) {
+        ctx = make_context();
+        if (stats_wanted) {
+            jsdev_collect(ctx, &total_stats);
+        }
+        if ((nr_profiles > 0 ? fan_file(ctx, inputs[0])
+                : one_file(ctx, inputs[0])) != 0 && !watching) {
+            return 1;
+        }
+        if (watching) {
+            run_watch();
+        }
+        return 0;
+    }
+    if (nr_jobs == 0) {
+        nr_jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (nr_jobs < 1) {
+            nr_jobs = 1;
+        }
+    }
+/*
+    Schedule the batch: largest files first, and any file bigger than a
+    fair share of the batch gets the whole parallel scanner to itself
+    before the pool divides the rest, so the wall time tracks the total
+    bytes instead of the biggest single file.
+*/
+    nr_huge = schedule_inputs();
+    if (nr_profiles > 0) {
+        nr_huge = 0;
+    }
+    if (nr_huge > 0) {
+        ctx = make_context();
+        memset(&huge_stats, 0, sizeof huge_stats);
+        if (stats_wanted) {
+            if (set != NULL) {
+                huge_stats.tag_matches = calloc(
+                    (size_t)jsdev_nr_tags(set) + 1,
+                    sizeof (unsigned long long));
+            }
+            jsdev_collect(ctx, &huge_stats);
+        }
+        split_input = TRUE;
+        for (i = 0; i < nr_huge; i += 1) {
+            if (one_file(ctx, inputs[i]) != 0) {
+                note_failure();
+            }
+        }
+        split_input = FALSE;
+        merge_stats(&huge_stats);
+    }
+    next_input = nr_huge;
+    if (nr_jobs > nr_inputs - nr_huge) {
+        nr_jobs = nr_inputs - nr_huge;
+    }
+    if (nr_jobs > 0) {
+        threads = malloc((size_t)nr_jobs * sizeof (pthread_t));
+        if (threads == NULL) {
+            die("out of memory.");
+        }
+        for (i = 0; i < nr_jobs; i += 1) {
+            if (pthread_create(&threads[i], NULL, work, NULL) != 0) {
+                die("cannot start worker thread.");
+            }
+        }
+        for (i = 0; i < nr_jobs; i += 1) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+    if (watching) {
+        run_watch();
+    }
+    return batch_status();
+}